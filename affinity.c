@@ -0,0 +1,168 @@
+#include <dirent.h>
+#include <errno.h>
+#include <sched.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "affinity.h"
+#include "tools.h"
+
+#define NODE_DIR "/sys/devices/system/node"
+#define CPU_DIR "/sys/devices/system/cpu"
+
+
+/* parse a sysfs CPU list like "0-3,8-11" into `set` */
+static int read_cpulist (char const * path, cpu_set_t * set)
+{
+	char buf[4096];
+
+	FILE * f = fopen(path, "r");
+	if (f == NULL) return -1;
+	char * line = fgets(buf, sizeof(buf), f);
+	fclose(f);
+	if (line == NULL) return -1;
+
+	CPU_ZERO(set);
+	for (char * p = line; *p && *p != '\n'; ) {
+		char * end;
+		long first = strtol(p, &end, 10);
+		if (end == p) return -1;
+		long last = first;
+		if (*end == '-') {
+			p = end + 1;
+			last = strtol(p, &end, 10);
+			if (end == p) return -1;
+		}
+		for (long cpu = first; cpu <= last && cpu < CPU_SETSIZE; ++cpu)
+			CPU_SET(cpu, set);
+		p = *end == ',' ? end + 1 : end;
+	}
+	return 0;
+}
+
+/* whether `cpu` is the first hardware thread of its core */
+static int first_sibling (int cpu)
+{
+	char path[128];
+	cpu_set_t siblings;
+
+	snprintf(path, sizeof(path), CPU_DIR "/cpu%d/topology/thread_siblings_list", cpu);
+	if (read_cpulist(path, &siblings) == -1) return 1;
+	for (int i = 0; i < cpu; ++i)
+		if (CPU_ISSET(i, &siblings)) return 0;
+	return 1;
+}
+
+static int add_node (affinity_t * affinity, int id, cpu_set_t const * cpus, cpu_set_t const * allowed)
+{
+	cpu_set_t set;
+	CPU_AND(&set, cpus, allowed);
+	int count = CPU_COUNT(&set);
+	if (count == 0) return 0;
+
+	affinity_node_t * nodes = realloc(affinity->nodes, (affinity->nnodes + 1) * sizeof(affinity_node_t));
+	if (nodes == NULL) return -1;
+	affinity->nodes = nodes;
+	affinity_node_t * node = &affinity->nodes[affinity->nnodes];
+	node->id = id;
+	node->ncpus = 0;
+	node->cpus = xmalloc(count * sizeof(int));
+	if (node->cpus == NULL) return -1;
+	node->next = 0;
+
+	/* first threads of the cores, then the rest */
+	for (int pass = 0; pass < 2; ++pass) {
+		for (int cpu = 0; cpu < CPU_SETSIZE; ++cpu) {
+			if (!CPU_ISSET(cpu, &set) || first_sibling(cpu) != !pass) continue;
+			node->cpus[node->ncpus++] = cpu;
+			if (cpu >= affinity->ncpus) affinity->ncpus = cpu + 1;
+		}
+	}
+	affinity->nnodes += 1;
+	return 0;
+}
+
+static int node_cmp (void const * a, void const * b)
+{
+	return ((affinity_node_t const *)a)->id - ((affinity_node_t const *)b)->id;
+}
+
+int affinity_init (affinity_t * affinity)
+{
+	cpu_set_t allowed;
+	cpu_set_t cpus;
+	char path[512];
+
+	memset(affinity, 0, sizeof(affinity_t));
+	if (sched_getaffinity(0, sizeof(allowed), &allowed) == -1) {
+		CPU_ZERO(&allowed);
+		for (int cpu = 0; cpu < CPU_SETSIZE; ++cpu) CPU_SET(cpu, &allowed);
+	}
+
+	DIR * dir = opendir(NODE_DIR);
+	struct dirent * entry;
+	int res = 0;
+	while (res == 0 && dir && (entry = readdir(dir))) {
+		int id;
+		char tail;
+		if (sscanf(entry->d_name, "node%d%c", &id, &tail) != 1) continue;
+		snprintf(path, sizeof(path), NODE_DIR "/%s/cpulist", entry->d_name);
+		if (read_cpulist(path, &cpus) == 0) res = add_node(affinity, id, &cpus, &allowed);
+	}
+	if (dir) closedir(dir);
+
+	if (res == 0 && affinity->nnodes == 0)
+		res = add_node(affinity, 0, &allowed, &allowed);
+	if (res == 0) affinity->cpu_node = xmalloc(affinity->ncpus * sizeof(int));
+	if (affinity->cpu_node == NULL) {
+		affinity_free(affinity);
+		errno = ENOMEM;
+		return -1;
+	}
+	qsort(affinity->nodes, affinity->nnodes, sizeof(affinity_node_t), node_cmp);
+
+	for (int cpu = 0; cpu < affinity->ncpus; ++cpu)
+		affinity->cpu_node[cpu] = -1;
+	for (int i = 0; i < affinity->nnodes; ++i)
+		for (int j = 0; j < affinity->nodes[i].ncpus; ++j)
+			affinity->cpu_node[affinity->nodes[i].cpus[j]] = i;
+	return 0;
+}
+
+void affinity_free (affinity_t * affinity)
+{
+	for (int i = 0; i < affinity->nnodes; ++i)
+		free(affinity->nodes[i].cpus);
+	free(affinity->nodes);
+	free(affinity->cpu_node);
+}
+
+void affinity_pin_cpu (affinity_t * affinity, int node, pthread_attr_t * attr)
+{
+	affinity_node_t * n = &affinity->nodes[node];
+	cpu_set_t set;
+
+	CPU_ZERO(&set);
+	CPU_SET(n->cpus[n->next], &set);
+	n->next = (n->next + 1) % n->ncpus;
+	pthread_attr_setaffinity_np(attr, sizeof(set), &set);
+}
+
+void affinity_pin_node (affinity_t * affinity, int node, pthread_attr_t * attr)
+{
+	affinity_node_t * n = &affinity->nodes[node];
+	cpu_set_t set;
+
+	CPU_ZERO(&set);
+	for (int i = 0; i < n->ncpus; ++i)
+		CPU_SET(n->cpus[i], &set);
+	pthread_attr_setaffinity_np(attr, sizeof(set), &set);
+}
+
+int affinity_current_node (affinity_t * affinity)
+{
+	int cpu = sched_getcpu();
+	if (cpu < 0 || cpu >= affinity->ncpus || affinity->cpu_node[cpu] == -1) return 0;
+	return affinity->cpu_node[cpu];
+}
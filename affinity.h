@@ -0,0 +1,39 @@
+#ifndef __AFFINITY_H__
+#define __AFFINITY_H__
+
+#include <pthread.h>
+
+/* CPU topology from sysfs, for pinning worker threads (--affinity).
+ *
+ * CPUs are grouped by NUMA node, leaving out those the process may not
+ * run on. Within a node, the first hardware thread of every core comes
+ * before the second ones, so that threads pinned one per CPU get a core
+ * of their own while there are cores left. Without NUMA information in
+ * sysfs, all CPUs are one node. */
+
+typedef struct affinity_node {
+	int id;			/* nodeN in sysfs */
+	int ncpus;
+	int * cpus;
+	int next;		/* next CPU to hand out */
+} affinity_node_t;
+
+typedef struct affinity {
+	int nnodes;
+	affinity_node_t * nodes;
+	/* node index of every CPU, -1 for CPUs we don't run on */
+	int ncpus;
+	int * cpu_node;
+} affinity_t;
+
+/* returns -1 and errno if out of memory */
+int affinity_init (affinity_t * affinity);
+void affinity_free (affinity_t * affinity);
+/* pin a thread to be created with `attr` to the next CPU of node
+ * index `node`, or to all of its CPUs */
+void affinity_pin_cpu (affinity_t * affinity, int node, pthread_attr_t * attr);
+void affinity_pin_node (affinity_t * affinity, int node, pthread_attr_t * attr);
+/* node index of the CPU the calling thread runs on, 0 if unknown */
+int affinity_current_node (affinity_t * affinity);
+
+#endif
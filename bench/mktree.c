@@ -0,0 +1,141 @@
+/* Deterministic synthetic trees for end-to-end benchmarks.
+ *
+ *   mktree DIR PROFILE [SCALE [SEED]]
+ *
+ * profiles: tiny   - many files of up to 4 kB, 100 per directory
+ *           mixed  - log-uniform sizes from 1 byte to 16 MB
+ *           huge   - a few 512 MB files
+ *           sparse - 1 GB files with 1 MB of data every 16 MB
+ * SCALE multiplies the number (tiny, mixed) or size (huge, sparse) of
+ * files. The same arguments always produce the same tree. Prints the
+ * number of files and bytes as JSON. */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <math.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <sys/stat.h>
+
+#define BUFSIZE (1024 * 1024)
+
+static uint64_t rng_state;
+
+static uint64_t rng (void)
+{
+	/* xorshift64* */
+	rng_state ^= rng_state >> 12;
+	rng_state ^= rng_state << 25;
+	rng_state ^= rng_state >> 27;
+	return rng_state * 0x2545F4914F6CDD1Dull;
+}
+
+static void rng_seed (uint64_t seed)
+{
+	rng_state = seed * 0x9E3779B97F4A7C15ull + 1;
+}
+
+static void die (char const * what, char const * path)
+{
+	fprintf(stderr, "mktree: %s %s: %s\n", what, path, strerror(errno));
+	exit(1);
+}
+
+static void make_dir (char const * path)
+{
+	if (mkdir(path, 0755) == -1 && errno != EEXIST) die("mkdir", path);
+}
+
+/* write `size` bytes of data from the current rng at `offset` */
+static void fill (int fd, char const * path, uint64_t offset, uint64_t size, char * buf)
+{
+	while (size) {
+		size_t n = size < BUFSIZE ? size : BUFSIZE;
+		for (size_t i = 0; i < n; i += 8) {
+			uint64_t r = rng();
+			memcpy(buf + i, &r, 8);
+		}
+		if (pwrite(fd, buf, n, offset) != (ssize_t)n) die("write", path);
+		offset += n;
+		size -= n;
+	}
+}
+
+/* file with `size` bytes, data only in the first `extent` bytes of every `stride` */
+static void make_file (char const * path, uint64_t size, uint64_t extent, uint64_t stride,
+                       char * buf)
+{
+	int fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+	if (fd == -1) die("create", path);
+	if (ftruncate(fd, size) == -1) die("truncate", path);
+	for (uint64_t off = 0; off < size; off += stride) {
+		uint64_t n = size - off < extent ? size - off : extent;
+		fill(fd, path, off, n, buf);
+	}
+	if (close(fd) == -1) die("close", path);
+}
+
+int main (int argc, char ** argv)
+{
+	if (argc < 3) {
+		fprintf(stderr, "Usage: mktree DIR tiny|mixed|huge|sparse [SCALE [SEED]]\n");
+		return 1;
+	}
+	char const * dir = argv[1];
+	char const * profile = argv[2];
+	double scale = argc > 3 ? atof(argv[3]) : 1;
+	uint64_t seed = argc > 4 ? strtoull(argv[4], NULL, 10) : 1;
+
+	char * buf = malloc(BUFSIZE);
+	char path[4096];
+	uint64_t files = 0, bytes = 0;
+
+	make_dir(dir);
+
+	if (!strcmp(profile, "tiny") || !strcmp(profile, "mixed")) {
+		int tiny = profile[0] == 't';
+		uint64_t count = (tiny ? 20000 : 1000) * scale;
+		for (uint64_t i = 0; i < count; ++i) {
+			rng_seed(seed ^ (i << 20));
+			uint64_t size = tiny ? rng() % 4096 : (uint64_t)exp2((rng() % 24000) / 1000.0);
+
+			snprintf(path, sizeof(path), "%s/d%02llu", dir, (unsigned long long)(i / 100 % 100));
+			make_dir(path);
+			snprintf(path, sizeof(path), "%s/d%02llu/d%03llu", dir,
+			         (unsigned long long)(i / 100 % 100), (unsigned long long)(i / 10000));
+			make_dir(path);
+			snprintf(path, sizeof(path), "%s/d%02llu/d%03llu/f%llu", dir,
+			         (unsigned long long)(i / 100 % 100), (unsigned long long)(i / 10000),
+			         (unsigned long long)i);
+			make_file(path, size, size, size ? size : 1, buf);
+			files += 1;
+			bytes += size;
+		}
+	} else if (!strcmp(profile, "huge") || !strcmp(profile, "sparse")) {
+		int sparse = profile[0] == 's';
+		uint64_t size = (uint64_t)((sparse ? 1024 : 512) * scale) << 20;
+		for (int i = 0; i < 4; ++i) {
+			rng_seed(seed ^ ((uint64_t)i << 40));
+			snprintf(path, sizeof(path), "%s/%s%d", dir, profile, i);
+			if (sparse)
+				make_file(path, size, 1 << 20, 16 << 20, buf);
+			else
+				make_file(path, size, size, size ? size : 1, buf);
+			files += 1;
+			bytes += size;
+		}
+	} else {
+		fprintf(stderr, "mktree: unknown profile %s\n", profile);
+		return 1;
+	}
+
+	printf("{\"profile\":\"%s\",\"scale\":%g,\"seed\":%llu,\"files\":%llu,\"bytes\":%llu}\n",
+	       profile, scale, (unsigned long long)seed, (unsigned long long)files,
+	       (unsigned long long)bytes);
+	free(buf);
+	return 0;
+}
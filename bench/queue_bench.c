@@ -0,0 +1,108 @@
+/* queue_t contention benchmark: moves items from P producer threads to
+ * C consumer threads, one at a time and in batches, and prints the
+ * throughput of every combination as one JSON object per line. */
+
+#include <stdatomic.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include <pthread.h>
+
+#include "queue.h"
+
+#define QUEUE_SIZE (16 * 1024)
+#define MAX_THREADS 8
+#define MAX_BATCH 16
+
+typedef struct {
+	queue_t queue;
+	size_t per_producer;
+	size_t batch;
+	_Atomic size_t consumed;
+} bench_t;
+
+static double now (void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void * producer (void * arg)
+{
+	bench_t * bench = arg;
+	void * items[MAX_BATCH];
+	for (size_t i = 0; i < MAX_BATCH; ++i) items[i] = (void *)(uintptr_t)(i + 1);
+
+	for (size_t i = 0; i < bench->per_producer; i += bench->batch) {
+		if (bench->batch == 1)
+			queue_push(&bench->queue, items[0]);
+		else
+			queue_push_many(&bench->queue, items, bench->batch);
+	}
+	return NULL;
+}
+
+static void * consumer (void * arg)
+{
+	bench_t * bench = arg;
+	void * items[MAX_BATCH];
+
+	for (;;) {
+		size_t n;
+		if (bench->batch == 1)
+			n = queue_pop(&bench->queue) != NULL;
+		else
+			n = queue_pop_many(&bench->queue, items, bench->batch);
+		if (n == 0) return NULL;
+		bench->consumed += n;
+	}
+}
+
+static void run (int producers, int consumers, size_t batch, size_t items)
+{
+	bench_t bench;
+	pthread_t threads[2 * MAX_THREADS];
+
+	queue_init(&bench.queue, QUEUE_SIZE);
+	bench.per_producer = items / producers / batch * batch;
+	bench.batch = batch;
+	atomic_init(&bench.consumed, 0);
+	size_t total = bench.per_producer * producers;
+
+	double start = now();
+	for (int i = 0; i < consumers; ++i)
+		pthread_create(&threads[i], NULL, consumer, &bench);
+	for (int i = 0; i < producers; ++i)
+		pthread_create(&threads[consumers + i], NULL, producer, &bench);
+
+	for (int i = 0; i < producers; ++i)
+		pthread_join(threads[consumers + i], NULL);
+	struct timespec pause = { .tv_sec = 0, .tv_nsec = 100 * 1000 };
+	while (bench.consumed < total) nanosleep(&pause, NULL);
+	double elapsed = now() - start;
+
+	queue_stop(&bench.queue);
+	for (int i = 0; i < consumers; ++i)
+		pthread_join(threads[i], NULL);
+	queue_free(&bench.queue);
+
+	printf("{\"bench\":\"queue\",\"producers\":%d,\"consumers\":%d,\"batch\":%zu,"
+	       "\"items\":%zu,\"seconds\":%.6f,\"mops\":%.3f}\n",
+	       producers, consumers, batch, total, elapsed, total / elapsed / 1e6);
+	fflush(stdout);
+}
+
+int main (int argc, char ** argv)
+{
+	size_t items = argc > 1 ? strtoull(argv[1], NULL, 10) : 2000000;
+	static int const counts[] = { 1, 2, 4, 8 };
+	static size_t const batches[] = { 1, MAX_BATCH };
+
+	for (int b = 0; b < 2; ++b)
+		for (int p = 0; p < 4; ++p)
+			for (int c = 0; c < 4; ++c)
+				run(counts[p], counts[c], batches[b], items);
+	return 0;
+}
@@ -0,0 +1,66 @@
+#!/bin/sh
+# Runs all benchmarks and writes the results as JSON lines to
+# $BENCH_OUT (default bench-results.jsonl), one object per measurement.
+#
+#   BENCH_DIR    where the synthetic trees live (default /tmp/fastsum-bench);
+#                they are only generated if missing
+#   BENCH_SCALE  size of the trees, see bench/mktree.c (default 1)
+#   BENCH_TIME   seconds per kernel measurement (default 0.5)
+#   BENCH_ARGS   extra fastsum arguments for the end-to-end runs
+#
+# Cold-cache runs need root to drop the page cache; without it they are
+# reported as skipped.
+
+set -e
+
+cd "$(dirname "$0")/.."
+BENCH_DIR=${BENCH_DIR:-/tmp/fastsum-bench}
+BENCH_SCALE=${BENCH_SCALE:-1}
+BENCH_TIME=${BENCH_TIME:-0.5}
+BENCH_OUT=${BENCH_OUT:-bench-results.jsonl}
+mkdir -p "$BENCH_DIR"
+
+now_ns () {
+	date +%s%N
+}
+
+emit () {
+	echo "$1" | tee -a "$BENCH_OUT"
+}
+
+: > "$BENCH_OUT"
+emit "{\"bench\":\"info\",\"commit\":\"$(git rev-parse --short HEAD 2>/dev/null)\",\"date\":\"$(date -u +%Y-%m-%dT%H:%M:%SZ)\",\"cpus\":$(nproc),\"kernel\":\"$(uname -r)\",\"scale\":$BENCH_SCALE}"
+
+bench/sha256_bench "$BENCH_TIME" | tee -a "$BENCH_OUT"
+bench/queue_bench | tee -a "$BENCH_OUT"
+
+for profile in tiny mixed huge sparse; do
+	tree="$BENCH_DIR/$profile-$BENCH_SCALE"
+	if [ ! -f "$tree.json" ]; then
+		rm -rf "$tree"
+		bench/mktree "$tree" $profile "$BENCH_SCALE" > "$tree.json.tmp"
+		mv "$tree.json.tmp" "$tree.json"
+	fi
+	files=$(sed 's/.*"files":\([0-9]*\).*/\1/' "$tree.json")
+	bytes=$(sed 's/.*"bytes":\([0-9]*\).*/\1/' "$tree.json")
+
+	for io in threads uring; do
+		for cache in cold warm; do
+			if [ $cache = cold ]; then
+				if ! (sync && echo 3 > /proc/sys/vm/drop_caches) 2>/dev/null; then
+					emit "{\"bench\":\"tree\",\"profile\":\"$profile\",\"io\":\"$io\",\"cache\":\"cold\",\"skipped\":true}"
+					continue
+				fi
+			else
+				./fastsum --io=$io $BENCH_ARGS "$tree" > /dev/null
+			fi
+			start=$(now_ns)
+			./fastsum --io=$io $BENCH_ARGS "$tree" > /dev/null
+			end=$(now_ns)
+			emit "$(awk -v p=$profile -v io=$io -v c=$cache -v f=$files -v b=$bytes -v ns=$((end - start)) 'BEGIN {
+				s = ns / 1e9
+				printf "{\"bench\":\"tree\",\"profile\":\"%s\",\"io\":\"%s\",\"cache\":\"%s\",\"files\":%d,\"bytes\":%d,\"seconds\":%.3f,\"mbps\":%.1f,\"files_per_s\":%.0f}", p, io, c, f, b, s, b / s / 1e6, f / s
+			}')"
+		done
+	done
+done
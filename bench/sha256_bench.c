@@ -0,0 +1,101 @@
+/* SHA256 kernel microbenchmark: GB/s of sha256_hash_block for short
+ * messages, data blocks and L2-sized inputs, and of sha256_hash_blocks
+ * for a full set of data blocks, for every kernel this CPU supports.
+ * Prints one JSON object per measurement. */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+#include "sha256.h"
+
+#define BLOCKSIZE (16 * 1024)
+#define MAX_LANES 16
+
+static double now (void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void report (char const * kernel, char const * call, char const * input, size_t size,
+                    size_t bytes, double seconds)
+{
+	printf("{\"bench\":\"sha256\",\"kernel\":\"%s\",\"call\":\"%s\",\"input\":\"%s\","
+	       "\"size\":%zu,\"bytes\":%zu,\"seconds\":%.6f,\"gbps\":%.3f}\n",
+	       kernel, call, input, size, bytes, seconds, bytes / seconds / 1e9);
+	fflush(stdout);
+}
+
+/* hash the same `size` bytes over and over for about `duration` seconds */
+static void bench_block (char const * kernel, char const * input, char const * data,
+                         size_t size, double duration)
+{
+	char result[HASH_SIZE];
+	size_t bytes = 0;
+	double start = now(), elapsed;
+
+	do {
+		/* check the clock every ~1 MB */
+		for (size_t done = 0; done < (1 << 20); done += size) {
+			sha256_hash_block(data, size, result);
+			bytes += size;
+		}
+	} while ((elapsed = now() - start) < duration);
+
+	report(kernel, "hash_block", input, size, bytes, elapsed);
+}
+
+static void bench_blocks (char const * kernel, char const * data, double duration)
+{
+	int lanes = sha256_lanes();
+	char const * blocks[MAX_LANES];
+	char results[MAX_LANES][HASH_SIZE];
+	char * result_ptrs[MAX_LANES];
+	for (int i = 0; i < lanes; ++i) {
+		blocks[i] = data + i * BLOCKSIZE;
+		result_ptrs[i] = results[i];
+	}
+
+	size_t bytes = 0;
+	double start = now(), elapsed;
+	do {
+		for (int i = 0; i < 16; ++i) {
+			sha256_hash_blocks(blocks, BLOCKSIZE, result_ptrs, lanes);
+			bytes += (size_t)lanes * BLOCKSIZE;
+		}
+	} while ((elapsed = now() - start) < duration);
+
+	report(kernel, "hash_blocks", "blocks", BLOCKSIZE, bytes, elapsed);
+}
+
+int main (int argc, char ** argv)
+{
+	static char const * const kernels[] = { "scalar", "shani", "armv8", "avx2", "avx512" };
+	double duration = argc > 1 ? atof(argv[1]) : 0.5;
+
+	/* L2 inputs: the L1 hashes of a 1 MiB and of a 1 GiB file */
+	size_t const l2_small = (1 << 20) / BLOCKSIZE * HASH_SIZE;
+	size_t const l2_large = (1 << 30) / BLOCKSIZE * HASH_SIZE;
+
+	size_t size = l2_large > MAX_LANES * BLOCKSIZE ? l2_large : MAX_LANES * BLOCKSIZE;
+	char * data = malloc(size);
+	if (data == NULL) return 1;
+	srand(1);
+	for (size_t i = 0; i < size; ++i) data[i] = rand();
+
+	for (size_t i = 0; i < sizeof(kernels) / sizeof(kernels[0]); ++i) {
+		char const * kernel = kernels[i];
+		if (sha256_select_kernel(kernel) == -1) continue;
+
+		bench_block(kernel, "short", data, 64, duration);
+		bench_block(kernel, "block", data, BLOCKSIZE, duration);
+		bench_block(kernel, "l2_1M", data, l2_small, duration);
+		bench_block(kernel, "l2_1G", data, l2_large, duration);
+		bench_blocks(kernel, data, duration);
+	}
+
+	free(data);
+	return 0;
+}
@@ -0,0 +1,66 @@
+#include "budget.h"
+
+void budget_init (budget_t * budget, size_t limit)
+{
+	budget->limit = limit;
+	pthread_mutex_init(&budget->mutex, NULL);
+	pthread_cond_init(&budget->released, NULL);
+	budget->used[BUDGET_BUFFERS] = 0;
+	budget->used[BUDGET_ARRAYS] = 0;
+	budget->peak = 0;
+	budget->waiting = 0;
+}
+
+void budget_destroy (budget_t * budget)
+{
+	pthread_mutex_destroy(&budget->mutex);
+	pthread_cond_destroy(&budget->released);
+}
+
+static int budget_fits (budget_t * budget, budget_kind_t kind, size_t bytes)
+{
+	size_t total = budget->used[BUDGET_BUFFERS] + budget->used[BUDGET_ARRAYS];
+
+	if (!budget->used[kind]) return 1;
+	if (kind == BUDGET_ARRAYS && budget->used[kind] + bytes > budget->limit / 2) return 0;
+	return total + bytes <= budget->limit;
+}
+
+int budget_acquire (budget_t * budget, budget_kind_t kind, size_t bytes, int wait)
+{
+	if (!budget->limit) return 1;
+
+	pthread_mutex_lock(&budget->mutex);
+	while (!budget_fits(budget, kind, bytes)) {
+		if (!wait) {
+			pthread_mutex_unlock(&budget->mutex);
+			return 0;
+		}
+		budget->waiting += 1;
+		pthread_cond_wait(&budget->released, &budget->mutex);
+		budget->waiting -= 1;
+	}
+	budget->used[kind] += bytes;
+	size_t total = budget->used[BUDGET_BUFFERS] + budget->used[BUDGET_ARRAYS];
+	if (total > budget->peak) budget->peak = total;
+	pthread_mutex_unlock(&budget->mutex);
+
+	return 1;
+}
+
+void budget_release (budget_t * budget, budget_kind_t kind, size_t bytes)
+{
+	if (!budget->limit || !bytes) return;
+
+	pthread_mutex_lock(&budget->mutex);
+	budget->used[kind] -= bytes;
+	if (budget->waiting) pthread_cond_broadcast(&budget->released);
+	pthread_mutex_unlock(&budget->mutex);
+}
+
+void budget_print_stats (budget_t * budget, FILE * out)
+{
+	if (!budget->limit) return;
+	fprintf(out, "memory budget: %zu kB, peak %zu kB in flight\n",
+	        budget->limit / 1024, budget->peak / 1024);
+}
@@ -0,0 +1,39 @@
+#ifndef __BUDGET_H__
+#define __BUDGET_H__
+
+#include <stddef.h>
+#include <stdio.h>
+#include <pthread.h>
+
+/* Memory budget for everything in flight. Readers charge it before they
+ * allocate and block while it is exhausted; memory is credited back as
+ * soon as it is freed.
+ *
+ * There are two kinds of charges. Buffers (data blocks and their task
+ * descriptors) always drain by themselves, hashing needs no memory.
+ * Arrays (L1 hash arrays) live until their file is complete, so they may
+ * only take half of the budget, or else files waiting for their last
+ * blocks could hold all of it. A charge bigger than what is allowed is
+ * let through when nothing else of its kind is charged, so there is
+ * always progress. */
+
+typedef enum { BUDGET_BUFFERS, BUDGET_ARRAYS } budget_kind_t;
+
+typedef struct budget {
+	size_t limit;		/* 0 = no limit, nothing is counted */
+
+	pthread_mutex_t mutex;
+	pthread_cond_t released;
+	size_t used[2];
+	size_t peak;
+	int waiting;
+} budget_t;
+
+void budget_init (budget_t * budget, size_t limit);
+void budget_destroy (budget_t * budget);
+/* charge `bytes`. if `wait` is 0, returns 0 instead of blocking */
+int budget_acquire (budget_t * budget, budget_kind_t kind, size_t bytes, int wait);
+void budget_release (budget_t * budget, budget_kind_t kind, size_t bytes);
+void budget_print_stats (budget_t * budget, FILE * out);
+
+#endif
@@ -0,0 +1,420 @@
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <sys/file.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "cache.h"
+#include "tools.h"
+
+#define INDEX_MAGIC "FSUMIDX1"
+#define LOG_MAGIC "FSUMLOG1"
+#define BYTE_ORDER_MARK 0x01020304
+/* entries start at this offset in both files */
+#define HEADER_SIZE 64
+
+/* new entries appended to the log at once */
+#define CACHE_BATCH 4096
+/* compact when the log has this many entries, or 1/16 of the index */
+#define CACHE_COMPACT_LOG (1024 * 1024)
+
+typedef struct cache_header {
+	char magic[8];
+	uint32_t entry_size;
+	uint32_t byte_order;
+	uint64_t count;
+} cache_header_t;
+
+
+void cache_key_from_stat (cache_key_t * key, struct stat const * st)
+{
+	memset(key, 0, sizeof(cache_key_t));
+	key->dev = st->st_dev;
+	key->ino = st->st_ino;
+	key->size = st->st_size;
+	key->mtime_ns = (int64_t)st->st_mtim.tv_sec * 1000000000 + st->st_mtim.tv_nsec;
+	key->ctime_ns = (int64_t)st->st_ctim.tv_sec * 1000000000 + st->st_ctim.tv_nsec;
+}
+
+static int key_cmp (cache_key_t const * a, cache_key_t const * b)
+{
+	if (a->dev != b->dev) return a->dev < b->dev ? -1 : 1;
+	if (a->ino != b->ino) return a->ino < b->ino ? -1 : 1;
+	return 0;
+}
+
+static int key_newer (cache_key_t const * a, cache_key_t const * b)
+{
+	if (a->ctime_ns != b->ctime_ns) return a->ctime_ns > b->ctime_ns;
+	return a->mtime_ns > b->mtime_ns;
+}
+
+static int key_matches (cache_key_t const * a, cache_key_t const * b)
+{
+	return a->size == b->size && a->mtime_ns == b->mtime_ns && a->ctime_ns == b->ctime_ns;
+}
+
+/* by identity, newest first */
+static int entry_sort_cmp (void const * pa, void const * pb)
+{
+	cache_entry_t const * a = pa;
+	cache_entry_t const * b = pb;
+	int c = key_cmp(&a->key, &b->key);
+	if (c) return c;
+	if (key_newer(&a->key, &b->key)) return -1;
+	if (key_newer(&b->key, &a->key)) return 1;
+	return 0;
+}
+
+static size_t key_slot (cache_t * cache, cache_key_t const * key)
+{
+	uint64_t h = key->ino * 0x9e3779b97f4a7c15ULL ^ key->dev * 0xc2b2ae3d27d4eb4fULL;
+	return (h ^ (h >> 29)) & cache->table_mask;
+}
+
+static void table_insert (cache_t * cache, cache_entry_t const * entry)
+{
+	size_t slot = key_slot(cache, &entry->key);
+	/* inode 0 doesn't exist, it marks empty slots */
+	while (cache->table[slot].key.ino) {
+		if (!key_cmp(&cache->table[slot].key, &entry->key)) {
+			if (key_newer(&entry->key, &cache->table[slot].key))
+				cache->table[slot] = *entry;
+			return;
+		}
+		slot = (slot + 1) & cache->table_mask;
+	}
+	cache->table[slot] = *entry;
+}
+
+static int header_valid (cache_header_t const * header, char const * magic)
+{
+	return !memcmp(header->magic, magic, sizeof(header->magic))
+	    && header->entry_size == sizeof(cache_entry_t)
+	    && header->byte_order == BYTE_ORDER_MARK;
+}
+
+static int write_all (int fd, void const * buf, size_t size)
+{
+	char const * p = buf;
+	while (size) {
+		ssize_t written = write(fd, p, size);
+		if (written == -1) {
+			if (errno == EINTR) continue;
+			return -1;
+		}
+		p += written;
+		size -= written;
+	}
+	return 0;
+}
+
+static int write_header (int fd, char const * magic, uint64_t count)
+{
+	char buf[HEADER_SIZE];
+	cache_header_t header;
+
+	memset(buf, 0, sizeof(buf));
+	memcpy(header.magic, magic, sizeof(header.magic));
+	header.entry_size = sizeof(cache_entry_t);
+	header.byte_order = BYTE_ORDER_MARK;
+	header.count = count;
+	memcpy(buf, &header, sizeof(header));
+
+	return write_all(fd, buf, sizeof(buf));
+}
+
+static int open_index (cache_t * cache)
+{
+	struct stat st;
+	cache_header_t header;
+
+	int fd = open(cache->path, O_RDONLY | O_CLOEXEC);
+	if (fd == -1) return errno == ENOENT ? 0 : -1;
+
+	if (fstat(fd, &st) == -1) goto error;
+	if (st.st_size == 0) {
+		close(fd);
+		return 0;
+	}
+
+	errno = EINVAL;
+	if (st.st_size < HEADER_SIZE) goto error;
+	if (pread(fd, &header, sizeof(header), 0) != sizeof(header)) goto error;
+	if (!header_valid(&header, INDEX_MAGIC)) goto error;
+	if (header.count > (st.st_size - HEADER_SIZE) / sizeof(cache_entry_t)) goto error;
+
+	cache->map_size = st.st_size;
+	cache->map = mmap(NULL, cache->map_size, PROT_READ, MAP_SHARED, fd, 0);
+	if (cache->map == MAP_FAILED) {
+		cache->map = NULL;
+		goto error;
+	}
+	madvise(cache->map, cache->map_size, MADV_RANDOM);
+
+	cache->index = (cache_entry_t const *)((char const *)cache->map + HEADER_SIZE);
+	cache->index_count = header.count;
+	close(fd);
+	return 0;
+
+error: ;
+	int err = errno;
+	close(fd);
+	errno = err;
+	return -1;
+}
+
+static int open_log (cache_t * cache)
+{
+	struct stat st;
+	cache_header_t header;
+
+	cache->log_fd = open(cache->log_path, O_RDWR | O_CREAT | O_APPEND | O_CLOEXEC, 0644);
+	if (cache->log_fd == -1) return -1;
+
+	/* only one process gets to add to the cache */
+	if (flock(cache->log_fd, LOCK_EX | LOCK_NB) == -1) {
+		if (errno != EWOULDBLOCK) return -1;
+		cache->readonly = 1;
+	}
+
+	if (fstat(cache->log_fd, &st) == -1) return -1;
+	if (st.st_size < HEADER_SIZE) {
+		if (cache->readonly) return 0;
+		if (ftruncate(cache->log_fd, 0) == -1) return -1;
+		return write_header(cache->log_fd, LOG_MAGIC, 0);
+	}
+
+	errno = EINVAL;
+	if (pread(cache->log_fd, &header, sizeof(header), 0) != sizeof(header)) return -1;
+	if (!header_valid(&header, LOG_MAGIC)) return -1;
+
+	size_t count = (st.st_size - HEADER_SIZE) / sizeof(cache_entry_t);
+	/* drop a record cut short by a crash, appends must stay aligned */
+	if (!cache->readonly && (st.st_size - HEADER_SIZE) % sizeof(cache_entry_t))
+		if (ftruncate(cache->log_fd, HEADER_SIZE + count * sizeof(cache_entry_t)) == -1) return -1;
+
+	size_t capacity = 16;
+	while (capacity < 2 * count) capacity <<= 1;
+	cache->table = xmalloc(capacity * sizeof(cache_entry_t));
+	if (cache->table == NULL) return -1;
+	cache->table_mask = capacity - 1;
+
+	cache_entry_t * buf = xmalloc(CACHE_BATCH * sizeof(cache_entry_t));
+	if (buf == NULL) return -1;
+	off_t offset = HEADER_SIZE;
+	size_t left = count;
+	while (left) {
+		size_t n = left < CACHE_BATCH ? left : CACHE_BATCH;
+		ssize_t bytes = pread(cache->log_fd, buf, n * sizeof(cache_entry_t), offset);
+		if (bytes <= 0) break;
+		n = bytes / sizeof(cache_entry_t);
+		for (size_t i = 0; i < n; ++i)
+			if (buf[i].key.ino) table_insert(cache, &buf[i]);
+		offset += n * sizeof(cache_entry_t);
+		left -= n;
+		cache->log_count += n;
+	}
+	free(buf);
+
+	return 0;
+}
+
+int cache_open (cache_t * cache, char const * path)
+{
+	memset(cache, 0, sizeof(cache_t));
+	cache->log_fd = -1;
+	pthread_mutex_init(&cache->mutex, NULL);
+
+	cache->path = strdup(path);
+	cache->log_path = xmalloc(strlen(path) + sizeof(".log"));
+	cache->batch = xmalloc(CACHE_BATCH * sizeof(cache_entry_t));
+	if (cache->log_path) {
+		strcpy(cache->log_path, path);
+		strcat(cache->log_path, ".log");
+	}
+
+	if (!cache->path || !cache->log_path || !cache->batch || open_index(cache) == -1 || open_log(cache) == -1) {
+		int err = errno;
+		cache->readonly = 1;
+		cache_close(cache);
+		errno = err;
+		return -1;
+	}
+	return 0;
+}
+
+int cache_lookup (cache_t * cache, cache_key_t const * key, char * hash)
+{
+	cache_entry_t const * found = NULL;
+
+	/* the log is newer than the index */
+	if (cache->table) {
+		size_t slot = key_slot(cache, key);
+		while (cache->table[slot].key.ino) {
+			if (!key_cmp(&cache->table[slot].key, key)) {
+				found = &cache->table[slot];
+				break;
+			}
+			slot = (slot + 1) & cache->table_mask;
+		}
+	}
+
+	if (found == NULL) {
+		size_t lo = 0, hi = cache->index_count;
+		while (lo < hi) {
+			size_t mid = lo + (hi - lo) / 2;
+			int c = key_cmp(&cache->index[mid].key, key);
+			if (c == 0) {
+				found = &cache->index[mid];
+				break;
+			}
+			if (c < 0)
+				lo = mid + 1;
+			else
+				hi = mid;
+		}
+	}
+
+	if (found == NULL || !key_matches(&found->key, key)) return 0;
+	memcpy(hash, found->hash, HASH_SIZE);
+	return 1;
+}
+
+/* called with mutex held. if the log can't be written, the cache is
+ * not updated any more */
+static int cache_flush (cache_t * cache)
+{
+	int res = 0;
+	if (!cache->batch_count) return 0;
+	if (write_all(cache->log_fd, cache->batch, cache->batch_count * sizeof(cache_entry_t)) == -1) {
+		cache->readonly = 1;
+		res = -1;
+	}
+	cache->batch_count = 0;
+	return res;
+}
+
+int cache_store (cache_t * cache, cache_key_t const * key, char const * hash)
+{
+	if (cache->readonly) return 0;
+
+	pthread_mutex_lock(&cache->mutex);
+	cache_entry_t * entry = &cache->batch[cache->batch_count++];
+	entry->key = *key;
+	memcpy(entry->hash, hash, HASH_SIZE);
+	int res = cache->batch_count == CACHE_BATCH ? cache_flush(cache) : 0;
+	int err = errno;
+	pthread_mutex_unlock(&cache->mutex);
+	errno = err;
+	return res;
+}
+
+/* merge the log into a new index and empty the log */
+static int cache_compact (cache_t * cache, size_t log_entries)
+{
+	size_t map_size = HEADER_SIZE + log_entries * sizeof(cache_entry_t);
+	/* private mapping, so we can sort it in place */
+	char * map = mmap(NULL, map_size, PROT_READ | PROT_WRITE, MAP_PRIVATE, cache->log_fd, 0);
+	if (map == MAP_FAILED) return -1;
+
+	cache_entry_t * log = (cache_entry_t *)(map + HEADER_SIZE);
+	qsort(log, log_entries, sizeof(cache_entry_t), entry_sort_cmp);
+
+	char * tmp_path = xmalloc(strlen(cache->path) + sizeof(".tmp"));
+	if (tmp_path == NULL) {
+		munmap(map, map_size);
+		errno = ENOMEM;
+		return -1;
+	}
+	strcpy(tmp_path, cache->path);
+	strcat(tmp_path, ".tmp");
+
+	FILE * out = NULL;
+	int fd = open(tmp_path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+	if (fd == -1 || write_header(fd, INDEX_MAGIC, 0) == -1) goto error;
+	out = fdopen(fd, "w");
+	if (out == NULL) goto error;
+
+	/* merge, skipping older entries for the same inode */
+	size_t i = 0, j = 0, count = 0;
+	cache_entry_t const * last = NULL;
+	while (i < cache->index_count || j < log_entries) {
+		cache_entry_t const * next;
+		if (j == log_entries)
+			next = &cache->index[i++];
+		else if (i == cache->index_count || entry_sort_cmp(&log[j], &cache->index[i]) <= 0)
+			next = &log[j++];
+		else
+			next = &cache->index[i++];
+
+		if (!next->key.ino || (last && !key_cmp(&last->key, &next->key))) continue;
+		if (fwrite(next, sizeof(cache_entry_t), 1, out) != 1) goto error;
+		last = next;
+		count += 1;
+	}
+	if (fflush(out) == EOF) goto error;
+
+	cache_header_t header;
+	memcpy(header.magic, INDEX_MAGIC, sizeof(header.magic));
+	header.entry_size = sizeof(cache_entry_t);
+	header.byte_order = BYTE_ORDER_MARK;
+	header.count = count;
+	if (pwrite(fd, &header, sizeof(header), 0) != sizeof(header)) goto error;
+	if (fsync(fd) == -1) goto error;
+	if (rename(tmp_path, cache->path) == -1) goto error;
+	fclose(out);
+
+	/* the index has it all now; a log left over is merged again next time */
+	int res = ftruncate(cache->log_fd, HEADER_SIZE);
+	int truncate_err = errno;
+	munmap(map, map_size);
+	free(tmp_path);
+	errno = truncate_err;
+	return res;
+
+error: ;
+	int err = errno;
+	if (out)
+		fclose(out);
+	else if (fd != -1)
+		close(fd);
+	unlink(tmp_path);
+	munmap(map, map_size);
+	free(tmp_path);
+	errno = err;
+	return -1;
+}
+
+int cache_close (cache_t * cache)
+{
+	int res = 0;
+	if (!cache->readonly) {
+		pthread_mutex_lock(&cache->mutex);
+		res = cache_flush(cache);
+		pthread_mutex_unlock(&cache->mutex);
+	}
+
+	struct stat st;
+	if (!cache->readonly && fstat(cache->log_fd, &st) == 0 && st.st_size > HEADER_SIZE) {
+		size_t log_entries = (st.st_size - HEADER_SIZE) / sizeof(cache_entry_t);
+		if (log_entries >= CACHE_COMPACT_LOG || log_entries * 16 >= cache->index_count)
+			res = cache_compact(cache, log_entries);
+	}
+	int err = errno;
+
+	if (cache->map) munmap(cache->map, cache->map_size);
+	if (cache->log_fd != -1) close(cache->log_fd);
+	pthread_mutex_destroy(&cache->mutex);
+	free(cache->table);
+	free(cache->batch);
+	free(cache->log_path);
+	free(cache->path);
+	errno = err;
+	return res;
+}
@@ -0,0 +1,70 @@
+#ifndef __CACHE_H__
+#define __CACHE_H__
+
+#include <stddef.h>
+#include <stdint.h>
+#include <pthread.h>
+#include <sys/stat.h>
+
+#include "sha256.h"
+
+/* Persistent checksum cache: maps file identity and stat metadata to the
+ * final hash, so that unchanged files need not be read again.
+ *
+ * On disk there is a sorted index (FILE), searched in place through mmap,
+ * and an append log (FILE.log) that collects new results in batches.
+ * When the log gets large compared to the index, cache_close merges it
+ * into a new index. If the same inode shows up more than once, the
+ * entry with the newest ctime wins. */
+
+typedef struct cache_key {
+	uint64_t dev;
+	uint64_t ino;
+	uint64_t size;
+	int64_t mtime_ns;
+	int64_t ctime_ns;
+} cache_key_t;
+
+typedef struct cache_entry {
+	cache_key_t key;
+	char hash[HASH_SIZE];
+} cache_entry_t;
+
+typedef struct cache {
+	char * path;
+	char * log_path;
+	int log_fd;
+	int readonly;		/* someone else holds the log, or it can't be written */
+
+	/* sorted index, mmap'd */
+	cache_entry_t const * index;
+	size_t index_count;
+	void * map;
+	size_t map_size;
+
+	/* entries from the log, open addressing by (dev, ino) */
+	cache_entry_t * table;
+	size_t table_mask;
+	size_t log_count;
+
+	/* new results waiting to be appended to the log */
+	pthread_mutex_t mutex;
+	cache_entry_t * batch;
+	size_t batch_count;
+} cache_t;
+
+void cache_key_from_stat (cache_key_t * key, struct stat const * st);
+
+/* returns 0 on success, -1 and errno on failure. if another process is
+ * adding to the cache, it is opened readonly */
+int cache_open (cache_t * cache, char const * path);
+/* returns 1 and fills `hash` if `key` is in the cache with the same metadata */
+int cache_lookup (cache_t * cache, cache_key_t const * key, char * hash);
+/* returns -1 and errno when the log can't be written, after which the
+ * cache is readonly */
+int cache_store (cache_t * cache, cache_key_t const * key, char const * hash);
+/* flushes the log and compacts it into the index if worthwhile. returns
+ * -1 and errno if either failed; the cache is closed all the same */
+int cache_close (cache_t * cache);
+
+#endif
@@ -0,0 +1,410 @@
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/vfs.h>
+
+#include <linux/fiemap.h>
+#include <linux/fs.h>
+#include <linux/magic.h>
+
+#include "digests.h"
+#include "tools.h"
+
+#define DIGESTS_MAGIC "FSUMDIG1"
+#define BYTE_ORDER_MARK 0x01020304
+/* extents start at this offset, hashes follow them */
+#define HEADER_SIZE 128
+
+/* header flags: the extent list was recorded */
+#define HAVE_EXTENTS 1
+
+/* blocks that are reused by their extents but read and checked anyway */
+#define DIGESTS_SAMPLES 16
+
+/* extents asked for at once, hashes written at once */
+#define FIEMAP_BATCH 256
+#define DIGESTS_BUFFER (2048 * HASH_SIZE)
+
+/* where the data is not known to be where FIEMAP says, or is not stored
+ * block by block */
+#define UNSAFE_FLAGS (FIEMAP_EXTENT_UNKNOWN | FIEMAP_EXTENT_DELALLOC | FIEMAP_EXTENT_ENCODED \
+                      | FIEMAP_EXTENT_DATA_ENCRYPTED | FIEMAP_EXTENT_NOT_ALIGNED \
+                      | FIEMAP_EXTENT_DATA_INLINE | FIEMAP_EXTENT_DATA_TAIL)
+/* these change without the data changing */
+#define IGNORED_FLAGS (FIEMAP_EXTENT_LAST | FIEMAP_EXTENT_SHARED | FIEMAP_EXTENT_MERGED)
+
+typedef struct digests_header {
+	char magic[8];
+	uint32_t byte_order;
+	uint32_t flags;
+	uint64_t block_size;
+	cache_key_t key;
+	uint64_t chunks;
+	uint64_t nextents;
+} digests_header_t;
+
+_Static_assert(sizeof(digests_header_t) <= HEADER_SIZE, "digests header");
+
+
+static int pwrite_all (int fd, void const * buf, size_t size, off_t offset)
+{
+	char const * p = buf;
+	while (size) {
+		ssize_t written = pwrite(fd, p, size, offset);
+		if (written == -1) {
+			if (errno == EINTR) continue;
+			return -1;
+		}
+		p += written;
+		size -= written;
+		offset += written;
+	}
+	return 0;
+}
+
+/* whether extents of the file may be trusted to change with its data */
+static int extents_trusted (int fd)
+{
+	struct statfs sfs;
+	int flags;
+
+	if (fstatfs(fd, &sfs) == -1 || sfs.f_type != BTRFS_SUPER_MAGIC) return 0;
+	/* nodatacow files are overwritten in place */
+	if (ioctl(fd, FS_IOC_GETFLAGS, &flags) == -1 || (flags & FS_NOCOW_FL)) return 0;
+	return 1;
+}
+
+/* the file's extents, after its dirty pages have been written out */
+static int read_extents (digests_t * digests, int fd)
+{
+	struct fiemap * fm = xmalloc(sizeof(struct fiemap) + FIEMAP_BATCH * sizeof(struct fiemap_extent));
+	if (fm == NULL) return -1;
+	size_t alloc = 0;
+	uint64_t start = 0;
+	uint32_t flags = FIEMAP_FLAG_SYNC;
+
+	for (;;) {
+		memset(fm, 0, sizeof(struct fiemap));
+		fm->fm_start = start;
+		fm->fm_length = FIEMAP_MAX_OFFSET - start;
+		fm->fm_flags = flags;
+		fm->fm_extent_count = FIEMAP_BATCH;
+		if (ioctl(fd, FS_IOC_FIEMAP, fm) == -1) {
+			free(fm);
+			return -1;
+		}
+		flags = 0;
+		if (fm->fm_mapped_extents == 0) break;
+
+		for (uint32_t i = 0; i < fm->fm_mapped_extents; ++i) {
+			struct fiemap_extent const * fe = &fm->fm_extents[i];
+			if (digests->nextents == alloc) {
+				alloc = alloc ? 2 * alloc : FIEMAP_BATCH;
+				digest_extent_t * extents = realloc(digests->extents, alloc * sizeof(digest_extent_t));
+				if (extents == NULL) {
+					free(fm);
+					return -1;
+				}
+				digests->extents = extents;
+			}
+			digest_extent_t * extent = &digests->extents[digests->nextents++];
+			extent->logical = fe->fe_logical;
+			extent->physical = fe->fe_physical;
+			extent->length = fe->fe_length;
+			extent->flags = fe->fe_flags;
+			extent->reserved = 0;
+		}
+
+		struct fiemap_extent const * last = &fm->fm_extents[fm->fm_mapped_extents - 1];
+		if (last->fe_flags & FIEMAP_EXTENT_LAST) break;
+		start = last->fe_logical + last->fe_length;
+	}
+
+	free(fm);
+	return 0;
+}
+
+/* without the memory, the range is simply read again */
+static void add_clean (digests_t * digests, uint64_t start, uint64_t end)
+{
+	uint64_t (*clean)[2] = realloc(digests->clean, (digests->nclean + 1) * sizeof(*digests->clean));
+	if (clean == NULL) return;
+	digests->clean = clean;
+	digests->clean[digests->nclean][0] = start;
+	digests->clean[digests->nclean][1] = end;
+	digests->nclean += 1;
+}
+
+/* the same bytes on disk, known to be there */
+static int extent_same (digest_extent_t const * a, digest_extent_t const * b, uint64_t pos)
+{
+	return a->physical + (pos - a->logical) == b->physical + (pos - b->logical)
+	    && !((a->flags ^ b->flags) & ~IGNORED_FLAGS)
+	    && !(a->flags & UNSAFE_FLAGS);
+}
+
+/* walk both extent lists up to `limit` in pieces where both map linearly
+ * or are holes, and mark the blocks of pieces that differ as dirty; the
+ * chunks between them are clean */
+static void diff_extents (digests_t * digests, digest_extent_t const * old, size_t nold, uint64_t limit)
+{
+	digest_extent_t const * new = digests->extents;
+	size_t nnew = digests->nextents;
+	uint64_t block_size = digests->block_size;
+	uint64_t clean_from = 0;
+	size_t i = 0, j = 0;
+
+	for (uint64_t pos = 0; pos < limit; ) {
+		while (i < nold && old[i].logical + old[i].length <= pos) ++i;
+		while (j < nnew && new[j].logical + new[j].length <= pos) ++j;
+		int in_old = i < nold && old[i].logical <= pos;
+		int in_new = j < nnew && new[j].logical <= pos;
+
+		uint64_t end = limit;
+		if (i < nold) {
+			uint64_t edge = in_old ? old[i].logical + old[i].length : old[i].logical;
+			if (edge < end) end = edge;
+		}
+		if (j < nnew) {
+			uint64_t edge = in_new ? new[j].logical + new[j].length : new[j].logical;
+			if (edge < end) end = edge;
+		}
+
+		/* holes in both read as zeros in both */
+		int same = in_old == in_new && (!in_old || extent_same(&old[i], &new[j], pos));
+		if (!same) {
+			uint64_t first = pos / block_size;
+			uint64_t stop = (end + block_size - 1) / block_size;
+			if (first > clean_from) add_clean(digests, clean_from, first);
+			if (stop > clean_from) clean_from = stop;
+		}
+		pos = end;
+	}
+
+	if (limit / block_size > clean_from) add_clean(digests, clean_from, limit / block_size);
+}
+
+/* read a few of the clean blocks, spread over the file, and see if their
+ * old hashes are right. freed space given to the same file at the same
+ * offset again looks unchanged, as when a file is truncated and rewritten */
+static int samples_match (digests_t * digests, int fd)
+{
+	uint64_t total = 0;
+	for (size_t i = 0; i < digests->nclean; ++i)
+		total += digests->clean[i][1] - digests->clean[i][0];
+
+	char * block = xmalloc(digests->block_size);
+	if (block == NULL) return 0;
+	char hash[HASH_SIZE];
+	int match = 1;
+	size_t range = 0;
+	uint64_t skipped = 0;	/* clean chunks in ranges before `range` */
+
+	for (int i = 0; i < DIGESTS_SAMPLES && match; ++i) {
+		uint64_t n = total * i / DIGESTS_SAMPLES;
+		while (n - skipped >= digests->clean[range][1] - digests->clean[range][0]) {
+			skipped += digests->clean[range][1] - digests->clean[range][0];
+			range += 1;
+		}
+		uint64_t chunk = digests->clean[range][0] + (n - skipped);
+
+		for (size_t done = 0; done < digests->block_size; ) {
+			ssize_t bytes = pread(fd, block + done, digests->block_size - done, chunk * digests->block_size + done);
+			if (bytes == -1 && errno == EINTR) continue;
+			if (bytes <= 0) {
+				match = 0;
+				break;
+			}
+			done += bytes;
+		}
+		if (!match) break;
+		sha256_hash_block(block, digests->block_size, hash);
+		match = !memcmp(hash, digests->old + chunk * HASH_SIZE, HASH_SIZE);
+	}
+
+	free(block);
+	return match;
+}
+
+/* map the previous sidecar and find what is still good in it */
+static void open_old (digests_t * digests, int fd, int trusted)
+{
+	struct stat st;
+	digests_header_t header;
+
+	int side = open(digests->path, O_RDONLY | O_CLOEXEC);
+	if (side == -1) return;
+
+	if (fstat(side, &st) == -1 || st.st_size < HEADER_SIZE) goto done;
+	if (pread(side, &header, sizeof(header), 0) != sizeof(header)) goto done;
+
+	uint64_t room = st.st_size - HEADER_SIZE;
+	if (memcmp(header.magic, DIGESTS_MAGIC, sizeof(header.magic)) || header.byte_order != BYTE_ORDER_MARK
+	    || header.block_size != digests->block_size
+	    || header.key.dev != digests->key.dev || header.key.ino != digests->key.ino
+	    || header.chunks != (header.key.size + header.block_size - 1) / header.block_size
+	    || header.nextents > room / sizeof(digest_extent_t)
+	    || header.chunks > (room - header.nextents * sizeof(digest_extent_t)) / HASH_SIZE)
+		goto done;
+
+	digests->map_size = st.st_size;
+	digests->map = mmap(NULL, digests->map_size, PROT_READ, MAP_SHARED, side, 0);
+	if (digests->map == MAP_FAILED) {
+		digests->map = NULL;
+		goto done;
+	}
+	digest_extent_t const * extents = (digest_extent_t const *)((char const *)digests->map + HEADER_SIZE);
+	digests->old = (char const *)(extents + header.nextents);
+
+	if (!memcmp(&header.key, &digests->key, sizeof(cache_key_t))) {
+		/* nothing changed */
+		if (header.chunks) add_clean(digests, 0, header.chunks);
+	} else if (trusted && (header.flags & HAVE_EXTENTS)) {
+		/* only blocks that are whole in both; the old tail block is
+		 * partial, or the file grew past it */
+		uint64_t limit = header.key.size < digests->key.size ? header.key.size : digests->key.size;
+		limit -= limit % digests->block_size;
+		diff_extents(digests, extents, header.nextents, limit);
+		if (digests->nclean && !samples_match(digests, fd)) digests->nclean = 0;
+	}
+
+	if (digests->nclean == 0) {
+		munmap(digests->map, digests->map_size);
+		digests->map = NULL;
+		digests->old = NULL;
+	}
+
+done:
+	close(side);
+}
+
+int digests_open (digests_t * digests, char const * dir, int fd, size_t block_size, int trust_extents)
+{
+	struct stat st;
+
+	memset(digests, 0, sizeof(digests_t));
+	digests->fd = -1;
+	digests->block_size = block_size;
+
+	if (fstat(fd, &st) == -1) return -1;
+	cache_key_from_stat(&digests->key, &st);
+	digests->chunks = (digests->key.size + block_size - 1) / block_size;
+
+	if (asprintf(&digests->path, "%s/%llx-%llx", dir, (unsigned long long)digests->key.dev,
+	             (unsigned long long)digests->key.ino) == -1) {
+		digests->path = NULL;
+		return -1;
+	}
+
+	int trusted = trust_extents && extents_trusted(fd) && read_extents(digests, fd) == 0;
+	digests->have_extents = trusted;
+	if (!trusted) {
+		free(digests->extents);
+		digests->extents = NULL;
+		digests->nextents = 0;
+	}
+	open_old(digests, fd, trusted);
+
+	if (asprintf(&digests->tmp_path, "%s.XXXXXX", digests->path) == -1) {
+		digests->tmp_path = NULL;
+		goto error;
+	}
+	digests->fd = mkostemp(digests->tmp_path, O_CLOEXEC);
+	if (digests->fd == -1) goto error;
+
+	digests->buffer = xmalloc(DIGESTS_BUFFER);
+	if (digests->buffer == NULL) goto error;
+	return 0;
+
+error: ;
+	int err = errno;
+	free(digests->tmp_path);
+	digests->tmp_path = NULL;
+	digests_close(digests);
+	errno = err;
+	return -1;
+}
+
+char const * digests_lookup (digests_t * digests, uint64_t chunk)
+{
+	size_t lo = 0, hi = digests->nclean;
+	while (lo < hi) {
+		size_t mid = lo + (hi - lo) / 2;
+		if (chunk >= digests->clean[mid][1])
+			lo = mid + 1;
+		else if (chunk < digests->clean[mid][0])
+			hi = mid;
+		else
+			return digests->old + chunk * HASH_SIZE;
+	}
+	return NULL;
+}
+
+static void flush (digests_t * digests)
+{
+	if (digests->buffered == 0 || digests->failed) return;
+	off_t offset = HEADER_SIZE + digests->nextents * sizeof(digest_extent_t)
+	             + (digests->written * HASH_SIZE - digests->buffered);
+	if (pwrite_all(digests->fd, digests->buffer, digests->buffered, offset) == -1)
+		digests->failed = errno;
+	digests->buffered = 0;
+}
+
+void digests_add (digests_t * digests, char const * hash)
+{
+	memcpy(digests->buffer + digests->buffered, hash, HASH_SIZE);
+	digests->buffered += HASH_SIZE;
+	digests->written += 1;
+	if (digests->buffered == DIGESTS_BUFFER) flush(digests);
+}
+
+int digests_commit (digests_t * digests)
+{
+	digests_header_t header;
+	char buf[HEADER_SIZE];
+
+	flush(digests);
+	if (digests->failed) {
+		errno = digests->failed;
+		return -1;
+	}
+
+	memset(buf, 0, sizeof(buf));
+	memset(&header, 0, sizeof(header));
+	memcpy(header.magic, DIGESTS_MAGIC, sizeof(header.magic));
+	header.byte_order = BYTE_ORDER_MARK;
+	header.flags = digests->have_extents ? HAVE_EXTENTS : 0;
+	header.block_size = digests->block_size;
+	header.key = digests->key;
+	header.chunks = digests->written;
+	header.nextents = digests->nextents;
+	memcpy(buf, &header, sizeof(header));
+
+	if (pwrite_all(digests->fd, buf, sizeof(buf), 0) == -1
+	    || pwrite_all(digests->fd, digests->extents, digests->nextents * sizeof(digest_extent_t), HEADER_SIZE) == -1
+	    || rename(digests->tmp_path, digests->path) == -1)
+		return -1;
+
+	free(digests->tmp_path);
+	digests->tmp_path = NULL;
+	return 0;
+}
+
+void digests_close (digests_t * digests)
+{
+	if (digests->tmp_path) unlink(digests->tmp_path);
+	if (digests->fd != -1) close(digests->fd);
+	if (digests->map) munmap(digests->map, digests->map_size);
+	free(digests->path);
+	free(digests->tmp_path);
+	free(digests->extents);
+	free(digests->clean);
+	free(digests->buffer);
+}
@@ -0,0 +1,74 @@
+#ifndef __DIGESTS_H__
+#define __DIGESTS_H__
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "cache.h"
+#include "sha256.h"
+
+/* L1 hash sidecars: the hash of every block of a big file, kept in a
+ * directory (--digests=DIR) as DIR/<dev>-<ino>, so that a later run can
+ * reuse the hashes of the blocks that did not change and read only the
+ * rest.
+ *
+ * A file whose size, mtime and ctime are what they were reuses all of
+ * them. Otherwise, if extents are trusted, the file's FIEMAP extent list
+ * is compared with the one recorded: a block that maps to the same
+ * physical bytes with the same flags as before holds the same data, on a
+ * filesystem that never overwrites in place. That is btrfs, for files
+ * without nodatacow, and only there extents are looked at. Every other
+ * block is read and hashed again.
+ *
+ * The sidecar is a header, the extent list and the L1 hashes in block
+ * order, which is also enough to verify any range of blocks on its own.
+ * The new sidecar is written to a temporary file as the hashes come, and
+ * renamed over the old one when the file is complete. */
+
+typedef struct digest_extent {
+	uint64_t logical;
+	uint64_t physical;
+	uint64_t length;
+	uint32_t flags;
+	uint32_t reserved;
+} digest_extent_t;
+
+typedef struct digests {
+	uint64_t block_size;
+	cache_key_t key;
+	uint64_t chunks;
+
+	/* the previous sidecar, mmap'd, and the ranges of chunks
+	 * [start, end) whose hashes in it are still good */
+	void * map;
+	size_t map_size;
+	char const * old;
+	uint64_t (*clean)[2];
+	size_t nclean;
+
+	/* the new one */
+	char * path;
+	char * tmp_path;
+	int fd;
+	digest_extent_t * extents;
+	size_t nextents;
+	int have_extents;	/* recorded, and to be trusted next time */
+	uint64_t written;	/* hashes added */
+	char * buffer;
+	size_t buffered;
+	int failed;		/* errno of a failed write */
+} digests_t;
+
+/* open the sidecar of the regular file `fd` in `dir` for blocks of
+ * `block_size`, and start a new one. returns 0, or -1 and errno */
+int digests_open (digests_t * digests, char const * dir, int fd, size_t block_size, int trust_extents);
+/* the old hash of `chunk` if it is still good, NULL if it has to be read */
+char const * digests_lookup (digests_t * digests, uint64_t chunk);
+/* the L1 hash of the next chunk, in order */
+void digests_add (digests_t * digests, char const * hash);
+/* all chunks are added; replace the old sidecar. returns 0, or -1 and errno */
+int digests_commit (digests_t * digests);
+/* drop the new sidecar unless committed, and free everything */
+void digests_close (digests_t * digests);
+
+#endif
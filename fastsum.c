@@ -0,0 +1,2063 @@
+#include <assert.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/sysinfo.h>
+
+#include <stdatomic.h>
+#include <pthread.h>
+
+#include "fastsum.h"
+#include "affinity.h"
+#include "budget.h"
+#include "cache.h"
+#include "digests.h"
+#include "iosched.h"
+#include "pool.h"
+#include "scan.h"
+#include "sha256.h"
+#include "stats.h"
+#include "queue.h"
+#include "tools.h"
+#include "uring.h"
+
+#define QUEUE_SIZE (16 * 1024)
+
+#define BIGFILE_LIMIT (256 * 1024)
+
+/* big files are split into extents of this size (or one block if that
+ * is bigger), read by up to this many threads at once */
+#define EXTENT_SIZE (1024 * 1024)
+#define READERS_PER_FILE 4
+
+/* blocks of a file are read this many bytes at a time into one buffer,
+ * and hashed in slices of it */
+#define READ_SIZE (1024 * 1024)
+
+/* pools grow by this much at a time */
+#define BLOCK_CHUNK (2 * 1024 * 1024)
+#define DESCRIPTOR_CHUNK (64 * 1024)
+
+/* io_uring reader: reads in flight per thread, files open at once */
+#define URING_DEPTH 256
+#define URING_FILES 64
+/* consecutive reads submitted for one file before moving to the next */
+#define URING_BURST 8
+/* registered buffers take at most this much, whatever the block size */
+#define URING_BUFFER_MEMORY (8 * 1024 * 1024)
+
+/* explicit readahead of big files, this far ahead of the reader. with
+ * --no-cache, pages read are dropped this many bytes at a time, or not
+ * cached at all with O_DIRECT, whose buffers and lengths are aligned */
+#define READAHEAD (4 * 1024 * 1024)
+#define DROP_BYTES (1024 * 1024)
+#define DIRECT_ALIGN 4096
+
+/* L1 hashes that finish ahead of the ones before them wait for their turn
+ * in a window of this many (64 MiB of data); readers don't go further */
+#define L2_WINDOW 4096
+
+_Static_assert(FASTSUM_HASH_SIZE == HASH_SIZE, "hash size");
+
+/* file task */
+typedef enum { STARTED, HASHED, CACHED } state_t;
+
+/* One level of the hash tree. Level 0 takes the L1 hashes, in order;
+ * with a fanout, every `fanout` of them are hashed into a node of the next
+ * level, and so on. The first level with at most `fanout` nodes is hashed
+ * into the final hash. Without a fanout there is only level 0, hashed
+ * into the final hash, which is the classic two-level scheme; so is any
+ * file of up to `fanout` blocks. Nodes come in order at every level, so
+ * each needs to hash only the group it is in right now. */
+typedef struct {
+	sha256_ctx_t ctx;
+	uint64_t count;		/* nodes in the current group */
+	uint64_t nodes;		/* nodes at this level so far */
+	char last[HASH_SIZE];	/* hash of the last complete group */
+} tree_level_t;
+
+
+typedef struct {
+	char * path;
+	uint64_t size;
+
+	/* submitted as an fd or a buffer rather than a path */
+	int fd;
+	char const * buffer;
+	void * tag;
+
+	/* the tree is fed L1 hashes in order as soon as they are there;
+	 * the ones that come early wait in window slots, chunk % window_size.
+	 * slots are followed by their ready flags */
+	tree_level_t * levels;
+	int nlevels;
+	char * window;
+	size_t window_size;
+	size_t window_alloc;	/* bytes charged to the memory budget */
+	_Atomic uint64_t next;	/* next L1 hash to feed */
+	int window_waiting;
+	int window_aborted;	/* a reader gave up, don't wait for it */
+	pthread_mutex_t window_mutex;
+	pthread_cond_t window_cond;
+
+	/* the reader's part, 1 until it is done posting, plus the chunks
+	 * posted and not hashed yet. whoever takes it to 0, reader or hash
+	 * worker, completes the file; nobody touches the file after their
+	 * own decrement */
+	_Atomic size_t outstanding;
+
+	state_t state;
+	char const * error;
+	int err;		/* errno behind error, if any */
+	/* not a file but a message for on_error, which error points to:
+	 * a cache that can't be used, a sidecar that can't be written */
+	char * notice;
+
+	/* identity for the checksum cache, valid if cacheable is set */
+	cache_key_t key;
+	int cacheable;
+
+	/* L1 hash sidecar of a big file, with --digests */
+	digests_t * digests;
+
+	/* data regions [start, end) of a sparse file, from SEEK_DATA and
+	 * SEEK_HOLE. blocks in the holes between them are not read */
+	uint64_t (*data)[2];
+	size_t ndata;
+	int sparse;
+
+	char result[HASH_SIZE];
+} file_t;
+
+
+/* hash task */
+/* buffer of several consecutive blocks, filled by one read and hashed in
+ * slices. it goes back to its pool when the last slice is hashed; a run
+ * shorter than run_blocks takes a block, or a buffer of the next run class */
+typedef struct {
+	char * data;
+	pool_t * pool;
+	size_t blocks;		/* that the buffer holds, as charged to the budget */
+	_Atomic size_t refs;
+} run_t;
+
+typedef struct {
+	char* result;
+	char* data;
+	pool_t * pool;	/* where data came from, NULL for a submitted buffer or a run */
+	run_t * run;	/* data is a slice of it */
+	size_t length;
+	file_t * file;
+	uint64_t chunk;
+	uint64_t started;	/* io_uring read submitted, for --stats */
+	int direct;		/* io_uring read with O_DIRECT */
+} hash_t;
+
+/* a data block and its descriptor, as charged to the memory budget */
+#define BLOCK_COST(ctx) ((ctx)->block_size + sizeof(hash_t))
+/* entries per shard in shard_names */
+#define SHARD_NAMES(ctx) (2 + (ctx)->run_classes)
+
+
+struct fastsum {
+	fastsum_options_t options;
+	size_t block_size;
+	size_t run_blocks;	/* blocks read at once */
+	int run_classes;	/* run buffers of 4, 16, 64... blocks, and run_blocks */
+	int use_uring;
+	char zero_hash[HASH_SIZE];	/* L1 hash of a block of zeros */
+
+	/* queues; with --affinity, blocks go to the hash workers through a
+	 * queue per NUMA node, and are read into memory of that node */
+	queue_t order_queue;	/* with disk_order, files by path on their way to file_queue */
+	queue_t file_queue;
+	queue_t * hash_queues;
+	int nshards;
+	char ** shard_names;	/* "hash<node>", "blocks<node>" and a name per run class, for the stats */
+	queue_t output_queue;
+	queue_t extent_queue;
+
+	/* memory pools */
+	pool_t * block_pools;
+	pool_t * run_pools;	/* run_classes per shard */
+	pool_t run_desc_pool;
+	pool_t hash_pool;
+	pool_t file_pool;
+	pool_t uring_pool;	/* fixed, registered with io_uring */
+
+	budget_t budget;
+	iosched_t iosched;
+	affinity_t affinity;
+
+	cache_t cache;
+	int use_cache;
+
+	/* threads */
+	scanner_t * scanner;
+	int file_threadnum;
+	int extent_threadnum;
+	int hash_threadnum;
+	pthread_t * file_threads;
+	pthread_t * extent_threads;
+	pthread_t * hash_threads;
+	pthread_t order_thread;
+	pthread_t output_thread;
+
+	uint64_t started;	/* for the scan time in --stats */
+	_Atomic int scanned;	/* directories were submitted */
+
+	_Atomic size_t files_posted;
+	_Atomic size_t files_done;
+	/* fastsum_wait sleeps until files_done catches up */
+	_Atomic int waiting;
+	pthread_mutex_t mutex;
+	pthread_cond_t done;
+
+	_Atomic int cancelled;
+};
+
+
+/* the hash queue and block pool of a worker, those of its NUMA node */
+static _Thread_local int thread_shard;
+
+static void worker_init (fastsum_t * ctx)
+{
+	if (ctx->nshards == 1) return;
+	int node = affinity_current_node(&ctx->affinity);
+	thread_shard = node < ctx->nshards ? node : 0;
+}
+
+static void hash_post (fastsum_t * ctx, hash_t * hash)
+{
+	hash->file->outstanding += 1;
+	queue_push(&ctx->hash_queues[thread_shard], hash);
+}
+
+/* memory, charged to the budget */
+
+/* reorder window for a file of `chunks` blocks, or for a stream with
+ * UINT64_MAX. returns 1 on success, 0 if the budget is exhausted and
+ * `wait` is 0, -1 and errno if out of memory */
+static int window_alloc (fastsum_t * ctx, file_t * file, uint64_t chunks, int wait)
+{
+	size_t size = chunks < L2_WINDOW ? (chunks ? chunks : 1) : L2_WINDOW;
+	size_t bytes = size * (HASH_SIZE + 1);
+	if (!budget_acquire(&ctx->budget, BUDGET_ARRAYS, bytes, wait)) return 0;
+
+	/* every level of the tree there may be; one is started above a level
+	 * as soon as it has `fanout` nodes */
+	unsigned fanout = ctx->options.fanout;
+	int levels = 1;
+	for (uint64_t nodes = chunks; fanout && nodes >= fanout; ++levels)
+		nodes = nodes / fanout + (nodes % fanout != 0);
+
+	file->window = calloc(1, bytes);
+	file->levels = calloc(levels, sizeof(tree_level_t));
+	if (file->window == NULL || file->levels == NULL) {
+		free(file->window);
+		free(file->levels);
+		file->window = NULL;
+		file->levels = NULL;
+		budget_release(&ctx->budget, BUDGET_ARRAYS, bytes);
+		return -1;
+	}
+	file->window_size = size;
+	file->window_alloc = bytes;
+	pthread_mutex_init(&file->window_mutex, NULL);
+	pthread_cond_init(&file->window_cond, NULL);
+	return 1;
+}
+
+static void window_free (fastsum_t * ctx, file_t * file)
+{
+	if (file->window == NULL) return;
+	pthread_mutex_destroy(&file->window_mutex);
+	pthread_cond_destroy(&file->window_cond);
+	free(file->window);
+	free(file->levels);
+	budget_release(&ctx->budget, BUDGET_ARRAYS, file->window_alloc);
+}
+
+/* where the L1 hash of `chunk` goes */
+static char * window_slot (file_t * file, uint64_t chunk)
+{
+	return file->window + chunk % file->window_size * HASH_SIZE;
+}
+
+/* whether `chunk` may be posted without overwriting a waiting L1 hash */
+static int window_room (file_t * file, uint64_t chunk)
+{
+	return chunk < file->next + file->window_size;
+}
+
+/* wait for room for `chunk`. returns -1 if the wait was given up */
+static int window_wait (file_t * file, uint64_t chunk)
+{
+	if (window_room(file, chunk)) return 0;
+
+	pthread_mutex_lock(&file->window_mutex);
+	file->window_waiting += 1;
+	while (!window_room(file, chunk) && !file->window_aborted)
+		pthread_cond_wait(&file->window_cond, &file->window_mutex);
+	file->window_waiting -= 1;
+	int res = window_room(file, chunk) ? 0 : -1;
+	pthread_mutex_unlock(&file->window_mutex);
+	return res;
+}
+
+/* a reader failed; chunks after the one it was to read will never be fed */
+static void window_abort (file_t * file)
+{
+	pthread_mutex_lock(&file->window_mutex);
+	file->window_aborted = 1;
+	pthread_cond_broadcast(&file->window_cond);
+	pthread_mutex_unlock(&file->window_mutex);
+}
+
+/* level `k` of the tree, which is there or one above the top. all of
+ * them are allocated with the window */
+static tree_level_t * tree_level (file_t * file, int k)
+{
+	if (k == file->nlevels) {
+		file->nlevels = k + 1;
+		sha256_init(&file->levels[k].ctx);
+	}
+	return &file->levels[k];
+}
+
+/* add a node to level `k` of the tree, under the window mutex */
+static void tree_feed (file_t * file, int k, char const * node, unsigned fanout)
+{
+	tree_level_t * level = tree_level(file, k);
+
+	sha256_update(&level->ctx, node, HASH_SIZE);
+	level->count += 1;
+	level->nodes += 1;
+	if (level->count == fanout) {
+		sha256_final(&level->ctx, level->last);
+		sha256_init(&level->ctx);
+		level->count = 0;
+		tree_feed(file, k + 1, level->last, fanout);
+	}
+}
+
+/* all L1 hashes are fed; close the groups that are left, bottom up */
+static void tree_final (file_t * file, unsigned fanout, char * result)
+{
+	for (int k = 0; ; ++k) {
+		tree_level_t * level = tree_level(file, k);
+		if (!fanout || level->nodes <= fanout) {
+			/* the top; if it has exactly `fanout` nodes, they are hashed already */
+			if (level->nodes && level->nodes == fanout)
+				memcpy(result, level->last, HASH_SIZE);
+			else
+				sha256_final(&level->ctx, result);
+			return;
+		}
+		if (level->count) {
+			sha256_final(&level->ctx, level->last);
+			level->count = 0;
+			tree_feed(file, k + 1, level->last, fanout);
+		}
+	}
+}
+
+/* the L1 hash of `chunk` is in its slot; feed what is in order */
+static void window_feed (file_t * file, uint64_t chunk, unsigned fanout)
+{
+	char * ready = file->window + file->window_size * HASH_SIZE;
+
+	pthread_mutex_lock(&file->window_mutex);
+	ready[chunk % file->window_size] = 1;
+	uint64_t next = file->next;
+	while (ready[next % file->window_size]) {
+		ready[next % file->window_size] = 0;
+		if (file->digests) digests_add(file->digests, window_slot(file, next));
+		tree_feed(file, 0, window_slot(file, next), fanout);
+		next += 1;
+	}
+	if (next != file->next) {
+		file->next = next;
+		if (file->window_waiting) pthread_cond_broadcast(&file->window_cond);
+	}
+	pthread_mutex_unlock(&file->window_mutex);
+}
+
+/* page cache: the kernel is told that a big file is read sequentially,
+ * if we opened it; with --no-cache, what was read is dropped */
+static void pagecache_open (fastsum_t * ctx, file_t * file, int fd)
+{
+	if (fd != file->fd && file->size >= ctx->options.bigfile_limit)
+		posix_fadvise(fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+}
+
+/* `length` 0 is to the end of the file */
+static void pagecache_drop (fastsum_t * ctx, int fd, uint64_t offset, uint64_t length)
+{
+	if (ctx->options.no_cache) posix_fadvise(fd, offset, length, POSIX_FADV_DONTNEED);
+}
+
+static void report (fastsum_t *, char const *, char const *, int);
+
+/* start the L1 hash sidecar of a big file, and see what of the old one
+ * can be used. without it the file is simply read all. returns -1 and
+ * errno if out of memory */
+static int file_digests_open (fastsum_t * ctx, file_t * file, int fd)
+{
+	if (!ctx->options.digests_path || file->size < ctx->options.bigfile_limit) return 0;
+
+	file->digests = xmalloc(sizeof(digests_t));
+	if (file->digests == NULL) return -1;
+	if (digests_open(file->digests, ctx->options.digests_path, fd, ctx->block_size,
+	                 ctx->options.digests_extents) == -1) {
+		report(ctx, file->path, "no L1 hash sidecar", errno);
+		free(file->digests);
+		file->digests = NULL;
+	}
+	return 0;
+}
+
+/* map the holes of a file that has fewer blocks allocated than its size
+ * takes. if the filesystem can't tell, the file is read all. returns -1
+ * and errno if out of memory */
+static int file_holes_open (fastsum_t * ctx, file_t * file, int fd)
+{
+	struct stat st;
+	if (file->size < ctx->block_size || fstat(fd, &st) == -1
+	    || (uint64_t)st.st_blocks * 512 >= file->size) return 0;
+
+	/* a submitted fd keeps its offset */
+	off_t saved = lseek(fd, 0, SEEK_CUR);
+	size_t alloc = 0;
+	off_t pos = 0;
+	for (;;) {
+		off_t data = lseek(fd, pos, SEEK_DATA);
+		if (data == -1) break;
+		off_t hole = lseek(fd, data, SEEK_HOLE);
+		if (hole == -1) break;
+		if (file->ndata == alloc) {
+			alloc = alloc ? 2 * alloc : 16;
+			uint64_t (*regions)[2] = realloc(file->data, alloc * sizeof(*file->data));
+			if (regions == NULL) {
+				if (saved != -1) lseek(fd, saved, SEEK_SET);
+				errno = ENOMEM;
+				return -1;
+			}
+			file->data = regions;
+		}
+		file->data[file->ndata][0] = data;
+		file->data[file->ndata][1] = hole;
+		file->ndata += 1;
+		pos = hole;
+	}
+	/* ENXIO: no data after pos */
+	file->sparse = errno == ENXIO;
+	if (saved != -1) lseek(fd, saved, SEEK_SET);
+	return 0;
+}
+
+/* whether [start, end) of the file is all hole */
+static int file_hole (file_t * file, uint64_t start, uint64_t end)
+{
+	if (!file->sparse) return 0;
+	/* the first data region that ends after start */
+	size_t lo = 0, hi = file->ndata;
+	while (lo < hi) {
+		size_t mid = (lo + hi) / 2;
+		if (file->data[mid][1] <= start) lo = mid + 1;
+		else hi = mid;
+	}
+	return lo == file->ndata || file->data[lo][0] >= end;
+}
+
+/* the L1 hash of `chunk` if it is known without reading it: a whole
+ * block in a hole is zeros, and the old hash from the sidecar may still
+ * be good. NULL if the chunk has to be read */
+static char const * known_hash (fastsum_t * ctx, file_t * file, uint64_t chunk)
+{
+	uint64_t offset = chunk * ctx->block_size;
+	if (offset + ctx->block_size <= file->size && file_hole(file, offset, offset + ctx->block_size))
+		return ctx->zero_hash;
+	return file->digests ? digests_lookup(file->digests, chunk) : NULL;
+}
+
+/* feed the known L1 hash of `chunk` instead of reading it. returns 1 if
+ * there is one */
+static int skip_chunk (fastsum_t * ctx, file_t * file, uint64_t chunk)
+{
+	char const * hash = known_hash(ctx, file, chunk);
+	if (hash == NULL) return 0;
+
+	memcpy(window_slot(file, chunk), hash, HASH_SIZE);
+	window_feed(file, chunk, ctx->options.fanout);
+	stats_count(hash == ctx->zero_hash ? &stats.blocks_sparse : &stats.blocks_reused, 1);
+	return 1;
+}
+
+/* hash task with a data block, from the registered io_uring buffers if
+ * `fixed` and there are some left. returns NULL if out of memory, or if
+ * the budget is exhausted and `wait` is 0 */
+static hash_t * block_alloc (fastsum_t * ctx, int fixed, int wait)
+{
+	if (!budget_acquire(&ctx->budget, BUDGET_BUFFERS, BLOCK_COST(ctx), wait)) return NULL;
+
+	pool_t * pool = &ctx->uring_pool;
+	char * data = fixed ? pool_alloc(pool) : NULL;
+	if (data == NULL) {
+		pool = &ctx->block_pools[thread_shard];
+		data = pool_alloc(pool);
+	}
+	hash_t * hash = pool_alloc(&ctx->hash_pool);
+	if (data == NULL || hash == NULL) {
+		pool_free(pool, data);
+		pool_free(&ctx->hash_pool, hash);
+		budget_release(&ctx->budget, BUDGET_BUFFERS, BLOCK_COST(ctx));
+		return NULL;
+	}
+
+	hash->data = data;
+	hash->pool = pool;
+	hash->run = NULL;
+	return hash;
+}
+
+/* blocks in a run buffer of class `class`; the last class is a full run */
+static size_t run_class_blocks (fastsum_t * ctx, int class)
+{
+	return class == ctx->run_classes - 1 ? ctx->run_blocks : (size_t)4 << 2 * class;
+}
+
+/* run of `blocks` blocks, with one reference for the reader. returns
+ * NULL if out of memory */
+static run_t * run_alloc (fastsum_t * ctx, size_t blocks)
+{
+	pool_t * pool = &ctx->block_pools[thread_shard];
+	if (blocks > 1) {
+		int class = 0;
+		while (run_class_blocks(ctx, class) < blocks) class += 1;
+		pool = &ctx->run_pools[thread_shard * ctx->run_classes + class];
+		blocks = run_class_blocks(ctx, class);
+	}
+	budget_acquire(&ctx->budget, BUDGET_BUFFERS, blocks * BLOCK_COST(ctx), 1);
+
+	run_t * run = pool_alloc(&ctx->run_desc_pool);
+	char * data = pool_alloc(pool);
+	if (run == NULL || data == NULL) {
+		pool_free(&ctx->run_desc_pool, run);
+		pool_free(pool, data);
+		budget_release(&ctx->budget, BUDGET_BUFFERS, blocks * BLOCK_COST(ctx));
+		return NULL;
+	}
+
+	run->data = data;
+	run->pool = pool;
+	run->blocks = blocks;
+	atomic_init(&run->refs, 1);
+	return run;
+}
+
+static void run_put (fastsum_t * ctx, run_t * run)
+{
+	if (--run->refs) return;
+	pool_free(run->pool, run->data);
+	budget_release(&ctx->budget, BUDGET_BUFFERS, run->blocks * BLOCK_COST(ctx));
+	pool_free(&ctx->run_desc_pool, run);
+}
+
+/* free a hash task that was never posted, or was hashed */
+static void block_free (fastsum_t * ctx, hash_t * hash)
+{
+	if (hash == NULL) return;
+	if (hash->pool) {
+		pool_free(hash->pool, hash->data);
+		budget_release(&ctx->budget, BUDGET_BUFFERS, BLOCK_COST(ctx));
+	} else if (hash->run) {
+		run_put(ctx, hash->run);
+	}
+	pool_free(&ctx->hash_pool, hash);
+}
+
+/* chunks from `chunk` on that can go into one run: up to run_blocks of
+ * them, before `end`, and none whose hash is known anyway. the reorder
+ * window has to take them all at once */
+static size_t run_length (fastsum_t * ctx, file_t * file, uint64_t chunk, uint64_t end)
+{
+	size_t max = ctx->run_blocks < file->window_size ? ctx->run_blocks : file->window_size;
+	size_t blocks = 1;
+	while (blocks < max && chunk + blocks < end && !known_hash(ctx, file, chunk + blocks))
+		blocks += 1;
+	return blocks;
+}
+
+/* read `blocks` chunks from `chunk` on with one pread (or more, if it
+ * comes up short) and post them as slices of one run. returns error or
+ * NULL */
+static char const * read_run (fastsum_t * ctx, file_t * file, int fd, uint64_t chunk, size_t blocks)
+{
+	size_t block_size = ctx->block_size;
+	uint64_t offset = chunk * block_size;
+	size_t length = file->size - offset < blocks * block_size ? file->size - offset : blocks * block_size;
+
+	run_t * run = run_alloc(ctx, blocks);
+	if (run == NULL) return "Out of memory";
+
+	for (size_t done = 0; done < length; ) {
+		uint64_t start = stats_clock();
+		ssize_t bytes = pread(fd, run->data + done, length - done, offset + done);
+		stats_record(&stats.read_latency, start);
+		if (bytes == -1 && errno == EINTR) continue;
+		if (bytes <= 0) {
+			char const * error = bytes ? strerror(errno) : "File shrank while hashing";
+			run_put(ctx, run);
+			return error;
+		}
+		stats_count(&stats.bytes_read, bytes);
+		done += bytes;
+	}
+
+	char const * error = NULL;
+	for (size_t i = 0; i < blocks; ++i) {
+		hash_t * hash = pool_alloc(&ctx->hash_pool);
+		if (hash == NULL) {
+			error = "Out of memory";
+			break;
+		}
+		run->refs += 1;
+		hash->data = run->data + i * block_size;
+		hash->pool = NULL;
+		hash->run = run;
+		hash->length = length - i * block_size < block_size ? length - i * block_size : block_size;
+		hash->file = file;
+		hash->chunk = chunk + i;
+		hash->result = window_slot(file, chunk + i);
+		hash_post(ctx, hash);
+	}
+	run_put(ctx, run);
+	return error;
+}
+
+
+/* worker threads */
+
+static void do_process_file (fastsum_t *, file_t *, io_device_t *);
+static void do_process_small (fastsum_t *, file_t *, io_device_t *, char **);
+static void do_process_buffer (fastsum_t *, file_t *);
+static void do_process_stream (fastsum_t *, file_t *);
+static int check_cache (fastsum_t *, file_t *, struct stat const *);
+static void do_complete_file_l1 (fastsum_t *, file_t *);
+static void do_output_file (fastsum_t *, file_t *);
+
+/* first error wins */
+static void file_fail (file_t * file, int err)
+{
+	if (file->error) return;
+	file->err = err;
+	file->error = strerror(err);
+}
+
+static int file_stat (file_t * file, struct stat * st)
+{
+	return file->fd == -1 ? stat(file->path, st) : fstat(file->fd, st);
+}
+
+/* a submitted pipe, socket or terminal. paths to those are refused, a
+ * stray fifo in a directory tree would block a reader forever */
+static int is_stream (file_t * file, struct stat const * st)
+{
+	return file->fd != -1 && (S_ISFIFO(st->st_mode) || S_ISSOCK(st->st_mode) || S_ISCHR(st->st_mode));
+}
+
+/* the reader's or a hash worker's part is done */
+static void file_release (fastsum_t * ctx, file_t * file)
+{
+	if (atomic_fetch_sub(&file->outstanding, 1) == 1) do_complete_file_l1(ctx, file);
+}
+
+/* the reader is done with the file, successfully or not */
+static void file_posted (fastsum_t * ctx, file_t * file)
+{
+	file_release(ctx, file);
+}
+
+static void * file_worker (void * arg)
+{
+	fastsum_t * ctx = arg;
+	struct stat st;
+	char * small = NULL;	/* for files of one block */
+
+	worker_init(ctx);
+
+	for (;;) {
+		file_t * file = queue_pop(&ctx->file_queue);
+		if (file == NULL) break;
+
+		if (ctx->cancelled) {
+			file_fail(file, ECANCELED);
+			queue_push(&ctx->output_queue, file);
+			continue;
+		}
+
+		if (file->buffer) {
+			do_process_buffer(ctx, file);
+			continue;
+		}
+
+		int res = file_stat(file, &st);
+		if (res == -1) {
+			file_fail(file, errno);
+			queue_push(&ctx->output_queue, file);
+			continue;
+		}
+
+		int mode = st.st_mode & S_IFMT;
+		if (is_stream(file, &st)) {
+			/* not a device we schedule, and it can't wait anyway */
+			do_process_stream(ctx, file);
+		} else if (mode == S_IFREG) {
+			if (check_cache(ctx, file, &st)) continue;
+			file->size = st.st_size;
+
+			/* if the device is busy, someone reading from it will take the file later */
+			io_device_t * device = iosched_device(&ctx->iosched, st.st_dev);
+			if (device == NULL) {
+				file_fail(file, ENOMEM);
+				queue_push(&ctx->output_queue, file);
+				continue;
+			}
+			if (!iosched_enter(&ctx->iosched, device, file)) continue;
+			do {
+				if (file->size <= ctx->block_size)
+					do_process_small(ctx, file, device, &small);
+				else
+					do_process_file(ctx, file, device);
+			} while ((file = iosched_next(&ctx->iosched, device)));
+		} else {
+			file->error = "Not a regular file";
+			queue_push(&ctx->output_queue, file);
+			continue;
+		}
+	}
+
+	free(small);
+	return NULL;
+}
+
+/* blocks from our node's queue; if it is empty, help the other nodes
+ * before going to sleep on ours */
+static size_t hash_take (fastsum_t * ctx, hash_t ** batch, size_t max)
+{
+	queue_t * own = &ctx->hash_queues[thread_shard];
+
+	if (ctx->nshards > 1) {
+		size_t count = queue_trypop_many(own, (void **)batch, max);
+		for (int i = 1; !count && i < ctx->nshards; ++i)
+			count = queue_trypop_many(&ctx->hash_queues[(thread_shard + i) % ctx->nshards], (void **)batch, max);
+		if (count) return count;
+	}
+	return queue_pop_many(own, (void **)batch, max);
+}
+
+static void * hash_worker (void * arg)
+{
+	fastsum_t * ctx = arg;
+	int lanes = sha256_lanes();
+	hash_t * batch[lanes];
+	char const * blocks[lanes];
+	char * results[lanes];
+
+	worker_init(ctx);
+	for (;;) {
+		size_t count = hash_take(ctx, batch, lanes);
+		if (count == 0) return NULL;
+
+		/* full-size blocks are hashed together, short ones
+		 * (file tails, most L2 hashes) one at a time */
+		int full = 0;
+		for (size_t i = 0; i < count; ++i) {
+			hash_t * hash = batch[i];
+			if (hash->length == ctx->block_size) {
+				blocks[full] = hash->data;
+				results[full] = hash->result;
+				full += 1;
+			} else {
+				uint64_t start = stats_clock();
+				sha256_hash_block(hash->data, hash->length, hash->result);
+				stats_record(&stats.hash_latency, start);
+			}
+		}
+		if (full) {
+			uint64_t start = stats_clock();
+			sha256_hash_blocks(blocks, ctx->block_size, results, full);
+			stats_record(&stats.hash_latency, start);
+		}
+		stats_count(&stats.blocks_hashed, count);
+
+		for (size_t i = 0; i < count; ++i) {
+			file_t * file = batch[i]->file;
+			window_feed(file, batch[i]->chunk, ctx->options.fanout);
+			block_free(ctx, batch[i]);
+			file_release(ctx, file);
+		}
+	}
+}
+
+/* big file read by several threads at once; the file worker that owns it
+ * hands it to readers-1 extent workers and everybody takes extents from
+ * next_extent until they run out */
+
+typedef struct {
+	fastsum_t * ctx;
+	file_t * file;
+	int fd;
+	uint64_t chunks;
+	uint64_t extent_blocks;
+	uint64_t extents;
+	_Atomic uint64_t next_extent;
+	_Atomic(char const *) error;
+
+	/* extent workers still busy with it */
+	int helpers;
+	pthread_mutex_t mutex;
+	pthread_cond_t done;
+} bigfile_t;
+
+/* read `chunk` and the ones after it that fit in its run, before `end`,
+ * and post them; or feed its hash if it is known. `count` is the number
+ * of chunks done. returns error or NULL */
+static char const * read_chunk (bigfile_t * big, uint64_t chunk, uint64_t end, size_t * count)
+{
+	fastsum_t * ctx = big->ctx;
+	file_t * file = big->file;
+
+	*count = 1;
+	/* the other readers gave up */
+	if (window_wait(file, chunk) == -1) return big->error;
+	if (skip_chunk(ctx, file, chunk)) return NULL;
+
+	size_t blocks = run_length(ctx, file, chunk, end);
+	if (window_wait(file, chunk + blocks - 1) == -1) return big->error;
+	char const * error = read_run(ctx, file, big->fd, chunk, blocks);
+	*count = blocks;
+	return error;
+}
+
+static void read_extents (bigfile_t * big)
+{
+	uint64_t extent;
+	while (!big->error && !big->ctx->cancelled && (extent = big->next_extent++) < big->extents) {
+		uint64_t first = extent * big->extent_blocks;
+		uint64_t end = first + big->extent_blocks < big->chunks ? first + big->extent_blocks : big->chunks;
+		/* the whole extent in one request, its blocks come from the page cache */
+		size_t block_size = big->ctx->block_size;
+		if (big->ctx->options.readahead && !file_hole(big->file, first * block_size, end * block_size))
+			readahead(big->fd, first * block_size, (end - first) * block_size);
+		for (uint64_t chunk = first; chunk < end; ) {
+			size_t count;
+			char const * error = read_chunk(big, chunk, end, &count);
+			chunk += count;
+			if (error) {
+				char const * none = NULL;
+				atomic_compare_exchange_strong(&big->error, &none, error);
+				/* readers of later chunks could wait for this one forever */
+				window_abort(big->file);
+				return;
+			}
+		}
+		pagecache_drop(big->ctx, big->fd, first * block_size, (end - first) * block_size);
+	}
+}
+
+static void * extent_worker (void * arg)
+{
+	fastsum_t * ctx = arg;
+
+	worker_init(ctx);
+	for (;;) {
+		bigfile_t * big = queue_pop(&ctx->extent_queue);
+		if (big == NULL) return NULL;
+
+		read_extents(big);
+
+		pthread_mutex_lock(&big->mutex);
+		if (--big->helpers == 0) pthread_cond_signal(&big->done);
+		pthread_mutex_unlock(&big->mutex);
+	}
+}
+
+/* read a big file with readers_per_file threads */
+static void do_read_parallel (fastsum_t * ctx, file_t * file, int fd, uint64_t chunks)
+{
+	int readers = ctx->options.readers_per_file;
+	uint64_t extent_blocks = ctx->block_size < EXTENT_SIZE ? EXTENT_SIZE / ctx->block_size : 1;
+	/* an extent is at least one run */
+	if (extent_blocks < ctx->run_blocks) extent_blocks = ctx->run_blocks;
+	bigfile_t big = {
+		.ctx = ctx,
+		.file = file,
+		.fd = fd,
+		.chunks = chunks,
+		.extent_blocks = extent_blocks,
+		.extents = (chunks + extent_blocks - 1) / extent_blocks,
+		.helpers = readers - 1,
+	};
+	atomic_init(&big.next_extent, 0);
+	atomic_init(&big.error, NULL);
+	pthread_mutex_init(&big.mutex, NULL);
+	pthread_cond_init(&big.done, NULL);
+
+	for (int i = 1; i < readers; ++i)
+		queue_push(&ctx->extent_queue, &big);
+	read_extents(&big);
+
+	pthread_mutex_lock(&big.mutex);
+	while (big.helpers) pthread_cond_wait(&big.done, &big.mutex);
+	pthread_mutex_unlock(&big.mutex);
+
+	/* anything past the size we started with means it grew */
+	char byte;
+	if (!big.error && pread(fd, &byte, 1, file->size) == 1)
+		big.error = "File grew while hashing";
+
+	file->error = big.error;
+	if (ctx->cancelled) file_fail(file, ECANCELED);
+	pthread_mutex_destroy(&big.mutex);
+	pthread_cond_destroy(&big.done);
+}
+
+/* io_uring reader: one thread keeps reads for many files in flight */
+
+typedef struct {
+	file_t * file;
+	int fd;
+	uint64_t chunks;
+	uint64_t next_chunk;	/* next chunk to submit */
+	size_t inflight;
+	int direct;		/* read with O_DIRECT, for --no-cache */
+} uring_file_t;
+
+/* returns 1 if the file is active, 0 if it went to the output queue,
+ * -1 if there is no budget for it yet and `wait` is 0 */
+static int uring_open_file (fastsum_t * ctx, file_t * file, uring_file_t * rf, int wait)
+{
+	struct stat st;
+
+	if (ctx->cancelled) {
+		file_fail(file, ECANCELED);
+	} else if (file->buffer) {
+		do_process_buffer(ctx, file);
+		return 0;
+	} else if (file_stat(file, &st) == -1) {
+		file_fail(file, errno);
+	} else if (is_stream(file, &st)) {
+		/* a stream is read with plain read(), and holds up the ring meanwhile */
+		do_process_stream(ctx, file);
+		return 0;
+	} else if ((st.st_mode & S_IFMT) != S_IFREG) {
+		file->error = "Not a regular file";
+	} else if (check_cache(ctx, file, &st)) {
+		return 0;
+	} else {
+		file->size = st.st_size;
+		rf->chunks = (file->size + ctx->block_size - 1) / ctx->block_size;
+		assert(rf->chunks <= SIZE_MAX / HASH_SIZE);
+		int res = window_alloc(ctx, file, rf->chunks, wait);
+		if (res == 0)
+			return -1;
+		else if (res == -1 || (rf->fd = file->fd != -1 ? file->fd : open(file->path, O_RDONLY)) == -1)
+			file_fail(file, errno);
+		else if (file_digests_open(ctx, file, rf->fd) == -1 || file_holes_open(ctx, file, rf->fd) == -1) {
+			file_fail(file, errno);
+			if (rf->fd != file->fd) close(rf->fd);
+		}
+	}
+
+	/* only our own fd is switched to O_DIRECT, and only if blocks are
+	 * aligned; where the filesystem refuses, pages are dropped instead */
+	rf->direct = 0;
+	if (!file->error && ctx->options.no_cache && rf->fd != file->fd && ctx->block_size % DIRECT_ALIGN == 0) {
+		int flags = fcntl(rf->fd, F_GETFL);
+		rf->direct = flags != -1 && fcntl(rf->fd, F_SETFL, flags | O_DIRECT) == 0;
+	}
+	if (!file->error && !rf->direct) pagecache_open(ctx, file, rf->fd);
+
+	if (file->error) {
+		queue_push(&ctx->output_queue, file);
+		return 0;
+	}
+
+	rf->file = file;
+	rf->next_chunk = 0;
+	rf->inflight = 0;
+	return 1;
+}
+
+static void uring_prep_read (fastsum_t * ctx, struct io_uring_sqe * sqe, uring_file_t * rf, hash_t * hash)
+{
+	sqe->opcode = hash->pool == &ctx->uring_pool ? IORING_OP_READ_FIXED : IORING_OP_READ;
+	sqe->fd = rf->fd;
+	sqe->addr = (uintptr_t)hash->data;
+	/* a direct read of the tail asks for whole sectors, it stops at eof */
+	sqe->len = rf->direct ? (hash->length + DIRECT_ALIGN - 1) & ~(size_t)(DIRECT_ALIGN - 1) : hash->length;
+	sqe->off = hash->chunk * ctx->block_size;
+	sqe->buf_index = 0;
+	sqe->user_data = (uintptr_t)hash;
+	hash->started = stats_clock();
+	hash->direct = rf->direct;
+}
+
+/* queue a read of the next chunk of `rf`. returns 0 if out of sqes, buffers
+ * or budget. waits for budget only if `wait` */
+static int uring_queue_read (fastsum_t * ctx, uring_t * ring, uring_file_t * rf, int fixed, int wait)
+{
+	/* registered buffers if we have them, regular ones if they ran out */
+	hash_t * hash = block_alloc(ctx, fixed, wait);
+	struct io_uring_sqe * sqe = hash ? uring_get_sqe(ring) : NULL;
+	if (sqe == NULL) {
+		block_free(ctx, hash);
+		return 0;
+	}
+
+	uint64_t chunk = rf->next_chunk++;
+	uint64_t offset = chunk * ctx->block_size;
+
+	hash->file = rf->file;
+	hash->chunk = chunk;
+	hash->result = window_slot(rf->file, chunk);
+	hash->length = rf->file->size - offset < ctx->block_size ? rf->file->size - offset : ctx->block_size;
+
+	uring_prep_read(ctx, sqe, rf, hash);
+	rf->inflight += 1;
+	return 1;
+}
+
+static void * uring_worker (void * arg)
+{
+	fastsum_t * ctx = arg;
+	uring_t ring;
+	uring_file_t active[URING_FILES];
+	int nactive = 0;
+	size_t inflight = 0;
+	size_t depth = ctx->options.io_depth;
+	file_t * deferred = NULL;	/* waiting for budget */
+
+	worker_init(ctx);
+	if (uring_init(&ring, ctx->options.io_depth) == -1) {
+		/* fastsum_create checked that io_uring works, but be safe */
+		return file_worker(arg);
+	}
+	pool_t * pool = &ctx->uring_pool;
+	struct iovec iov = { .iov_base = pool->chunk_count ? pool->chunks[0] : NULL, .iov_len = pool->chunk_size };
+	int fixed = pool->chunk_count && uring_register_buffers(&ring, &iov, 1) == 0;
+
+	for (;;) {
+		/* take in new files, block only if there is nothing else to do */
+		while (nactive < URING_FILES) {
+			file_t * file = deferred;
+			if (file) {
+				deferred = NULL;
+			} else if (nactive == 0) {
+				file = queue_pop(&ctx->file_queue);
+				if (file == NULL) goto done;
+			} else if (!queue_trypop_many(&ctx->file_queue, (void **)&file, 1)) {
+				break;
+			}
+			/* our own reads in flight hold budget, so only wait if there are none */
+			int res = uring_open_file(ctx, file, &active[nactive], nactive == 0);
+			if (res == 1) {
+				nactive += 1;
+			} else if (res == -1) {
+				deferred = file;
+				break;
+			}
+		}
+
+		/* fill the ring, a burst of consecutive reads per file */
+		int progress = 1;
+		while (progress) {
+			progress = 0;
+			for (int i = 0; i < nactive; ++i) {
+				uring_file_t * rf = &active[i];
+				if (ctx->cancelled) file_fail(rf->file, ECANCELED);
+				for (int b = 0; b < URING_BURST; ++b) {
+					if (rf->file->error || rf->next_chunk == rf->chunks) break;
+					if (!window_room(rf->file, rf->next_chunk)) break;
+					if (skip_chunk(ctx, rf->file, rf->next_chunk)) {
+						rf->next_chunk += 1;
+						progress = 1;
+						continue;
+					}
+					if (inflight >= depth || !uring_queue_read(ctx, &ring, rf, fixed, !inflight))
+						goto submit;
+					inflight += 1;
+					progress = 1;
+				}
+			}
+		}
+
+		/* nothing in flight, so no completion to wait for: every file is
+		 * ahead of its hash workers, wait for one of them to catch up */
+		if (!inflight && nactive) {
+			uring_file_t * rf = &active[0];
+			if (!rf->file->error && rf->next_chunk < rf->chunks)
+				window_wait(rf->file, rf->next_chunk);
+		}
+
+	submit:
+		/* with the ring full, wait until it is below io_depth again. EBUSY:
+		 * completions have to be reaped first, the reads go in next time */
+		if (uring_submit(&ring, inflight >= depth ? inflight - depth + 1 : inflight ? 1 : 0) == -1
+		    && errno != EBUSY) {
+			/* the reads the kernel didn't take fail their files; those
+			 * it took complete as usual */
+			int err = errno;
+			struct io_uring_sqe * sqe;
+			while ((sqe = uring_unsubmit(&ring))) {
+				hash_t * hash = (hash_t *)(uintptr_t)sqe->user_data;
+				uring_file_t * rf = active;
+				while (rf->file != hash->file) rf += 1;
+				file_fail(rf->file, err);
+				rf->inflight -= 1;
+				inflight -= 1;
+				block_free(ctx, hash);
+			}
+		}
+
+		/* collect finished reads */
+		struct io_uring_cqe * cqe;
+		while ((cqe = uring_peek_cqe(&ring))) {
+			hash_t * hash = (hash_t *)(uintptr_t)cqe->user_data;
+			int res = cqe->res;
+			uring_cqe_seen(&ring);
+			inflight -= 1;
+			stats_record(&stats.read_latency, hash->started);
+
+			uring_file_t * rf = active;
+			while (rf->file != hash->file) rf += 1;
+			rf->inflight -= 1;
+
+			/* stricter alignment than we know of: read the rest buffered */
+			struct io_uring_sqe * sqe;
+			if (res == -EINVAL && hash->direct && (sqe = uring_get_sqe(&ring))) {
+				if (rf->direct) fcntl(rf->fd, F_SETFL, fcntl(rf->fd, F_GETFL) & ~O_DIRECT);
+				rf->direct = 0;
+				uring_prep_read(ctx, sqe, rf, hash);
+				rf->inflight += 1;
+				inflight += 1;
+				continue;
+			}
+			if (res < 0) {
+				file_fail(rf->file, -res);
+				block_free(ctx, hash);
+				continue;
+			}
+			if ((size_t)res != hash->length) {
+				if (!rf->file->error) rf->file->error = "File changed while hashing";
+				block_free(ctx, hash);
+				continue;
+			}
+
+			stats_count(&stats.bytes_read, res);
+			if (!rf->direct) pagecache_drop(ctx, rf->fd, hash->chunk * ctx->block_size, res);
+			hash_post(ctx, hash);
+		}
+
+		/* retire files that have nothing more in flight */
+		for (int i = 0; i < nactive; ) {
+			uring_file_t * rf = &active[i];
+			if (rf->inflight || (!rf->file->error && rf->next_chunk < rf->chunks)) {
+				++i;
+				continue;
+			}
+			if (rf->fd != rf->file->fd) close(rf->fd);
+			file_posted(ctx, rf->file);
+			active[i] = active[--nactive];
+		}
+	}
+
+done:
+	uring_free(&ring);
+	return NULL;
+}
+
+/* calls back with results and errors, so that they don't get interleaved */
+/* with disk_order, files found by path are sorted into disk order in
+ * batches: what has come in while the batch was being located, up to
+ * disk_order files. with a directory walk running, that is usually all */
+static void * order_worker (void * arg)
+{
+	fastsum_t * ctx = arg;
+	size_t window = ctx->options.disk_order;
+	file_t ** files = xmalloc(window * sizeof(file_t *));
+	iosched_order_t * orders = xmalloc(window * sizeof(iosched_order_t));
+
+	/* without the memory to sort, files go on one by one as they come */
+	file_t * one;
+	iosched_order_t one_order;
+	int sorting = files && orders;
+	if (!sorting) {
+		free(files);
+		free(orders);
+		files = &one;
+		orders = &one_order;
+		window = 1;
+	}
+
+	for (;;) {
+		size_t count = queue_pop_many(&ctx->order_queue, (void **)files, window);
+		if (count == 0) break;
+
+		for (size_t done = 0; done < count; ) {
+			for (; done < count; ++done) {
+				orders[done].item = files[done];
+				iosched_locate(&orders[done], files[done]->path);
+			}
+			if (count < window)
+				count += queue_trypop_many(&ctx->order_queue, (void **)files + count, window - count);
+		}
+
+		iosched_sort(orders, count);
+		for (size_t i = 0; i < count; ++i)
+			files[i] = orders[i].item;
+		queue_push_many(&ctx->file_queue, (void **)files, count);
+	}
+
+	if (sorting) {
+		free(files);
+		free(orders);
+	}
+	return NULL;
+}
+
+static void * output_worker (void * arg)
+{
+	fastsum_t * ctx = arg;
+
+	for (;;) {
+		file_t * file = queue_pop(&ctx->output_queue);
+		if (file == NULL) return NULL;
+		do_output_file(ctx, file);
+	}
+}
+
+
+/* auxilliary functions */
+
+static file_t * file_alloc (fastsum_t * ctx, void * tag)
+{
+	file_t * file = pool_alloc(&ctx->file_pool);
+	if (file == NULL) return NULL;
+
+	memset(file, 0, sizeof(file_t));
+	atomic_init(&file->outstanding, 1);
+	file->fd = -1;
+	file->tag = tag;
+	file->state = STARTED;
+	return file;
+}
+
+static void file_dealloc (fastsum_t * ctx, file_t * file)
+{
+	window_free(ctx, file);
+	if (file->digests) {
+		digests_close(file->digests);
+		free(file->digests);
+	}
+	free(file->data);
+	free(file->path);
+	free(file->notice);
+	pool_free(&ctx->file_pool, file);
+
+	ctx->files_done += 1;
+	if (ctx->waiting) {
+		pthread_mutex_lock(&ctx->mutex);
+		pthread_cond_broadcast(&ctx->done);
+		pthread_mutex_unlock(&ctx->mutex);
+	}
+}
+
+/* counted as posted before it is queued, so that fastsum_wait can't miss it */
+static void file_post (fastsum_t * ctx, queue_t * queue, file_t * file)
+{
+	ctx->files_posted += 1;
+	queue_push(queue, file);
+}
+
+/* a file to be read by path, through the disk order stage if there is one */
+static void file_post_path (fastsum_t * ctx, file_t * file)
+{
+	file_post(ctx, ctx->options.disk_order ? &ctx->order_queue : &ctx->file_queue, file);
+}
+
+/* tell the application about a problem with `name` that is not an error
+ * of a submitted file, through on_error with a NULL tag. `what` is what
+ * it means for the run, `err` the errno behind it or 0 */
+static void report (fastsum_t * ctx, char const * name, char const * what, int err)
+{
+	file_t * file = file_alloc(ctx, NULL);
+	if (file == NULL) return;
+
+	int res = err ? asprintf(&file->notice, "%s (%s)", what, strerror(err)) : asprintf(&file->notice, "%s", what);
+	if (res == -1) file->notice = NULL;
+	file->path = strdup(name);
+	if (file->notice == NULL || file->path == NULL) {
+		free(file->notice);
+		free(file->path);
+		pool_free(&ctx->file_pool, file);
+		return;
+	}
+	file->error = file->notice;
+	file->err = err;
+
+	/* the output thread would wait for itself */
+	if (pthread_equal(pthread_self(), ctx->output_thread)) {
+		ctx->files_posted += 1;
+		do_output_file(ctx, file);
+	} else {
+		file_post(ctx, &ctx->output_queue, file);
+	}
+}
+
+static void do_process_file (fastsum_t * ctx, file_t * file, io_device_t * device)
+{
+	int err_flag = 1;
+	int fd = file->fd;
+
+	/* big files on a rotational disk are read alone */
+	int big = file->size >= ctx->options.bigfile_limit;
+	iosched_begin_read(device, big);
+
+	/* simplistic read()ing */
+	if (fd == -1) fd = open(file->path, O_RDONLY);
+	if (fd == -1) goto end;
+
+	size_t block_size = ctx->block_size;
+	uint64_t chunks = file->size / block_size;
+	assert(chunks <= SIZE_MAX);
+	if (file->size % block_size) chunks += 1;
+
+	if (window_alloc(ctx, file, chunks, 1) == -1 || file_digests_open(ctx, file, fd) == -1
+	    || file_holes_open(ctx, file, fd) == -1) goto end;
+	pagecache_open(ctx, file, fd);
+
+	if (big && !device->rotational && ctx->options.readers_per_file > 1) {
+		do_read_parallel(ctx, file, fd, chunks);
+		err_flag = 0;
+		goto end;
+	}
+
+	/* read ahead in steps of a quarter of the window, drop behind */
+	size_t window = big ? ctx->options.readahead : 0;
+	size_t step = window / 4 > block_size ? window / 4 : block_size;
+	uint64_t ahead = 0;
+	uint64_t dropped = 0;
+
+	for (uint64_t chunk = 0; chunk < chunks; ) {
+		uint64_t offset = chunk * block_size;
+		if (ctx->cancelled) {
+			errno = ECANCELED;
+			goto end;
+		}
+		window_wait(file, chunk);
+		if (skip_chunk(ctx, file, chunk)) {
+			chunk += 1;
+			continue;
+		}
+		/* not over a hole just skipped */
+		if (ahead < offset) ahead = offset;
+		for (; window && ahead < offset + window && ahead < file->size; ahead += step)
+			readahead(fd, ahead, step);
+		if (offset - dropped >= DROP_BYTES) {
+			pagecache_drop(ctx, fd, dropped, offset - dropped);
+			dropped = offset;
+		}
+
+		size_t blocks = run_length(ctx, file, chunk, chunks);
+		window_wait(file, chunk + blocks - 1);
+		char const * error = read_run(ctx, file, fd, chunk, blocks);
+		if (error) {
+			file->error = error;
+			goto end;
+		}
+		chunk += blocks;
+	}
+
+	/* anything past the size we started with means it grew */
+	char byte;
+	if (pread(fd, &byte, 1, file->size) == 1) {
+		file->error = "File grew while hashing";
+		goto end;
+	}
+
+	err_flag = 0;
+end:
+	if (err_flag) file_fail(file, errno);
+	iosched_end_read(device, big);
+	if (fd != -1) pagecache_drop(ctx, fd, 0, 0);
+	if (fd != file->fd) close(fd);
+	file_posted(ctx, file);
+}
+
+/* a file of at most one block is read at once into the worker's own
+ * buffer and hashed right here, both levels, without any hash task; only
+ * the result goes on to the output. the buffer is charged to the budget
+ * while it holds a file, a charge for the worker's life would keep the
+ * budget from ever draining */
+static void do_process_small (fastsum_t * ctx, file_t * file, io_device_t * device, char ** buffer)
+{
+	size_t block_size = ctx->block_size;
+	size_t length = 0;
+	int fd = file->fd;
+
+	/* a byte more than a block tells that it grew. without the memory
+	 * for it, the file is read like any other */
+	if (*buffer == NULL) *buffer = xmalloc(block_size + 1);
+	if (*buffer == NULL) {
+		do_process_file(ctx, file, device);
+		return;
+	}
+
+	/* in the order do_process_file takes them: a big reader holding the
+	 * device waits for budget */
+	iosched_begin_read(device, 0);
+	budget_acquire(&ctx->budget, BUDGET_BUFFERS, block_size + 1, 1);
+	if (fd == -1) fd = open(file->path, O_RDONLY);
+	if (fd == -1) {
+		file_fail(file, errno);
+	} else {
+		uint64_t start = stats_clock();
+		while (length <= block_size) {
+			ssize_t bytes = pread(fd, *buffer + length, block_size + 1 - length, length);
+			if (bytes == -1 && errno == EINTR) continue;
+			if (bytes == -1) file_fail(file, errno);
+			if (bytes <= 0) break;
+			length += bytes;
+		}
+		stats_record(&stats.read_latency, start);
+		pagecache_drop(ctx, fd, 0, 0);
+		if (fd != file->fd) close(fd);
+	}
+	iosched_end_read(device, 0);
+
+	if (!file->error && length > block_size) file->error = "File grew while hashing";
+	if (!file->error && length < file->size) file->error = "File shrank while hashing";
+	if (!file->error) {
+		stats_count(&stats.bytes_read, length);
+		uint64_t start = stats_clock();
+		if (length) {
+			/* a single node is the top of any tree */
+			char l1[HASH_SIZE];
+			sha256_hash_block(*buffer, length, l1);
+			sha256_hash_block(l1, HASH_SIZE, file->result);
+			stats_count(&stats.blocks_hashed, 1);
+		} else {
+			sha256_hash_block(*buffer, 0, file->result);
+		}
+		stats_record(&stats.hash_latency, start);
+		file->state = HASHED;
+	}
+	budget_release(&ctx->budget, BUDGET_BUFFERS, block_size + 1);
+	queue_push(&ctx->output_queue, file);
+}
+
+/* a submitted buffer is already in memory; post it as it is */
+static void do_process_buffer (fastsum_t * ctx, file_t * file)
+{
+	size_t block_size = ctx->block_size;
+	uint64_t chunks = (file->size + block_size - 1) / block_size;
+
+	if (window_alloc(ctx, file, chunks, 1) == -1) {
+		file_fail(file, errno);
+		chunks = 0;
+	}
+
+	for (uint64_t chunk = 0; chunk < chunks; ++chunk) {
+		window_wait(file, chunk);
+		hash_t * hash = pool_alloc(&ctx->hash_pool);
+		if (hash == NULL) {
+			file_fail(file, errno);
+			break;
+		}
+		uint64_t offset = chunk * block_size;
+		hash->data = (char *)file->buffer + offset;
+		hash->pool = NULL;
+		hash->run = NULL;
+		hash->file = file;
+		hash->chunk = chunk;
+		hash->result = window_slot(file, chunk);
+		hash->length = file->size - offset < block_size ? file->size - offset : block_size;
+		hash_post(ctx, hash);
+	}
+
+	file_posted(ctx, file);
+}
+
+/* fill a block from a pipe, which may return less at a time. returns bytes
+ * read, short only at eof, or -1 */
+static ssize_t read_full (int fd, char * data, size_t size)
+{
+	size_t done = 0;
+	while (done < size) {
+		ssize_t bytes = read(fd, data + done, size - done);
+		if (bytes == -1 && errno == EINTR) continue;
+		if (bytes == -1) return -1;
+		if (bytes == 0) break;
+		done += bytes;
+	}
+	return done;
+}
+
+/* a pipe, socket or terminal: read it to the end in full blocks, which
+ * go to the hash workers while reading goes on */
+static void do_process_stream (fastsum_t * ctx, file_t * file)
+{
+	uint64_t chunk = 0;
+	hash_t * hash = NULL;
+
+	if (window_alloc(ctx, file, UINT64_MAX, 1) == -1) {
+		file_fail(file, errno);
+		file_posted(ctx, file);
+		return;
+	}
+
+	for (;;) {
+		if (ctx->cancelled) {
+			file_fail(file, ECANCELED);
+			break;
+		}
+		window_wait(file, chunk);
+		hash = block_alloc(ctx, 0, 1);
+		if (hash == NULL) {
+			file_fail(file, errno);
+			break;
+		}
+
+		uint64_t start = stats_clock();
+		ssize_t bytes = read_full(file->fd, hash->data, ctx->block_size);
+		stats_record(&stats.read_latency, start);
+		if (bytes <= 0) {
+			if (bytes == -1) file_fail(file, errno);
+			break;
+		}
+		stats_count(&stats.bytes_read, bytes);
+		file->size += bytes;
+
+		hash->file = file;
+		hash->chunk = chunk;
+		hash->result = window_slot(file, chunk);
+		hash->length = bytes;
+
+		hash_post(ctx, hash);
+		chunk += 1;
+		hash = NULL;
+
+		if (bytes < ctx->block_size) break;
+	}
+
+	block_free(ctx, hash);
+	file_posted(ctx, file);
+}
+
+/* look the file up in the checksum cache; a hit goes straight to output */
+static int check_cache (fastsum_t * ctx, file_t * file, struct stat const * st)
+{
+	if (!ctx->use_cache) return 0;
+
+	cache_key_from_stat(&file->key, st);
+	file->cacheable = 1;
+	if (!cache_lookup(&ctx->cache, &file->key, file->result)) return 0;
+	stats_count(&stats.cache_hits, 1);
+
+	file->state = CACHED;
+	queue_push(&ctx->output_queue, file);
+	return 1;
+}
+
+/* all blocks are hashed, and their L1 hashes fed to the L2 hash */
+static void do_complete_file_l1 (fastsum_t * ctx, file_t * file)
+{
+	if (!file->error) {
+		tree_final(file, ctx->options.fanout, file->result);
+		file->state = HASHED;
+		if (file->digests && digests_commit(file->digests) == -1)
+			report(ctx, file->path, "L1 hash sidecar not written", errno);
+	}
+	queue_push(&ctx->output_queue, file);
+}
+
+static void do_output_file (fastsum_t * ctx, file_t * file)
+{
+	fastsum_options_t * options = &ctx->options;
+
+	if (file->notice) {
+		if (options->on_error)
+			options->on_error(file->path, file->error, file->err, NULL, options->arg);
+		file_dealloc(ctx, file);
+		return;
+	}
+
+	/* whatever was still on its way when cancelled */
+	if (ctx->cancelled) file_fail(file, ECANCELED);
+
+	stats_count(&stats.files, 1);
+	if (file->error) {
+		stats_count(&stats.errors, 1);
+		if (options->on_error)
+			options->on_error(file->path, file->error, file->err, file->tag, options->arg);
+		file_dealloc(ctx, file);
+		return;
+	}
+
+	if (file->cacheable && file->state == HASHED && cache_store(&ctx->cache, &file->key, file->result) == -1)
+		report(ctx, options->cache_path, "checksum cache not updated any more", errno);
+
+	if (options->on_result)
+		options->on_result(file->path, file->result, file->tag, options->arg);
+	file_dealloc(ctx, file);
+}
+
+
+/* directory scanner callbacks */
+
+static void scan_error (char const * path, int err, void * tag, void * arg)
+{
+	fastsum_t * ctx = arg;
+
+	/* report error in output thread */
+	file_t * dir = file_alloc(ctx, tag);
+	if (dir == NULL) return;
+
+	file_fail(dir, err);
+	dir->path = strdup(path);
+	file_post(ctx, &ctx->output_queue, dir);
+}
+
+static void scan_found_file (char * path, unsigned char d_type, void * tag, void * arg)
+{
+	fastsum_t * ctx = arg;
+	file_t * file = file_alloc(ctx, tag);
+	if (file == NULL) {
+		scan_error(path, ENOMEM, tag, arg);
+		free(path);
+		return;
+	}
+
+	file->path = path;
+	file_post_path(ctx, file);
+}
+
+/* everything but the threads, which are gone or were never started */
+static void fastsum_free (fastsum_t * ctx)
+{
+	free(ctx->file_threads);
+	free(ctx->extent_threads);
+	free(ctx->hash_threads);
+
+	if (ctx->options.disk_order) queue_free(&ctx->order_queue);
+	queue_free(&ctx->file_queue);
+	for (int i = 0; i < ctx->nshards; ++i) {
+		queue_free(&ctx->hash_queues[i]);
+		for (int j = 0; j < SHARD_NAMES(ctx); ++j)
+			free(ctx->shard_names[SHARD_NAMES(ctx) * i + j]);
+	}
+	free(ctx->hash_queues);
+	free(ctx->shard_names);
+	queue_free(&ctx->output_queue);
+	queue_free(&ctx->extent_queue);
+	iosched_free(&ctx->iosched);
+
+	for (int i = 0; i < ctx->nshards; ++i)
+		pool_destroy(&ctx->block_pools[i]);
+	for (int i = 0; i < ctx->nshards * ctx->run_classes; ++i)
+		pool_destroy(&ctx->run_pools[i]);
+	free(ctx->block_pools);
+	free(ctx->run_pools);
+	pool_destroy(&ctx->run_desc_pool);
+	if (ctx->options.affinity) affinity_free(&ctx->affinity);
+	pool_destroy(&ctx->hash_pool);
+	pool_destroy(&ctx->file_pool);
+	if (ctx->use_uring) pool_destroy(&ctx->uring_pool);
+	budget_destroy(&ctx->budget);
+
+	pthread_mutex_destroy(&ctx->mutex);
+	pthread_cond_destroy(&ctx->done);
+	free(ctx);
+}
+
+/* public interface */
+
+/* with --affinity, pinned to the next CPU of `node`, or to the whole node */
+static void start_worker (fastsum_t * ctx, pthread_t * thread, void * (*fn) (void *), int node, int cpu,
+                          char const * name, char const * stage)
+{
+	pthread_attr_t attr;
+
+	pthread_attr_init(&attr);
+	if (ctx->options.affinity && cpu)
+		affinity_pin_cpu(&ctx->affinity, node, &attr);
+	else if (ctx->options.affinity)
+		affinity_pin_node(&ctx->affinity, node, &attr);
+	pthread_create(thread, &attr, fn, ctx);
+	pthread_attr_destroy(&attr);
+	pthread_setname_np(*thread, name);
+	stats_add_thread(stage, *thread);
+}
+
+void fastsum_options_init (fastsum_options_t * options)
+{
+	memset(options, 0, sizeof(fastsum_options_t));
+	options->hash_threads = get_nprocs();
+	options->block_size = FASTSUM_BLOCK_SIZE;
+	options->scan_threads = 4;
+	options->bigfile_limit = BIGFILE_LIMIT;
+	options->readers_per_file = READERS_PER_FILE;
+	options->io_depth = URING_DEPTH;
+	options->readahead = READAHEAD;
+	options->read_size = READ_SIZE;
+}
+
+fastsum_t * fastsum_create (fastsum_options_t const * options)
+{
+	/* blocks need to be of a sensible size and the tree must narrow */
+	if (options->block_size < FASTSUM_MIN_BLOCK_SIZE || options->block_size > FASTSUM_MAX_BLOCK_SIZE
+	    || options->block_size % FASTSUM_MIN_BLOCK_SIZE || options->fanout == 1) {
+		errno = EINVAL;
+		return NULL;
+	}
+
+	fastsum_t * ctx = calloc(1, sizeof(fastsum_t));
+	if (ctx == NULL) return NULL;
+
+	ctx->options = *options;
+	ctx->block_size = options->block_size;
+	ctx->run_blocks = options->read_size > ctx->block_size ? options->read_size / ctx->block_size : 1;
+	ctx->run_classes = 1;
+	for (size_t blocks = 4; blocks < ctx->run_blocks; blocks *= 4)
+		ctx->run_classes += 1;
+	options = &ctx->options;
+
+	static char const zeros[64 * 1024];
+	sha256_ctx_t zero;
+	sha256_init(&zero);
+	for (size_t done = 0; done < ctx->block_size; done += sizeof(zeros))
+		sha256_update(&zero, zeros, ctx->block_size - done < sizeof(zeros) ? ctx->block_size - done : sizeof(zeros));
+	sha256_final(&zero, ctx->zero_hash);
+	int pool_flags = options->hugepages ? POOL_HUGEPAGES : 0;
+	int file_threadnum = options->file_threads ? options->file_threads : 16;
+	if (ctx->options.readers_per_file < 1) ctx->options.readers_per_file = 1;
+	ctx->started = stats_clock();
+
+	ctx->hash_threadnum = options->hash_threads > 0 ? options->hash_threads : 1;
+	ctx->nshards = 1;
+	if (options->affinity) {
+		if (affinity_init(&ctx->affinity) == -1) {
+			free(ctx);
+			return NULL;
+		}
+		/* every node with a queue needs a hash worker of its own */
+		ctx->nshards = ctx->affinity.nnodes < ctx->hash_threadnum ? ctx->affinity.nnodes : ctx->hash_threadnum;
+	}
+
+	ctx->block_pools = xmalloc(ctx->nshards * sizeof(pool_t));
+	ctx->run_pools = xmalloc(ctx->nshards * ctx->run_classes * sizeof(pool_t));
+	ctx->hash_queues = xmalloc(ctx->nshards * sizeof(queue_t));
+	ctx->shard_names = xmalloc(SHARD_NAMES(ctx) * ctx->nshards * sizeof(char *));
+	if (!ctx->block_pools || !ctx->run_pools || !ctx->hash_queues || !ctx->shard_names) {
+		free(ctx->block_pools);
+		free(ctx->run_pools);
+		free(ctx->hash_queues);
+		free(ctx->shard_names);
+		if (options->affinity) affinity_free(&ctx->affinity);
+		free(ctx);
+		errno = ENOMEM;
+		return NULL;
+	}
+
+	/* initialize memory pools; blocks of a node are touched first by its
+	 * readers, which puts them in its memory */
+	budget_init(&ctx->budget, options->max_memory);
+	size_t block_chunk = ctx->block_size < BLOCK_CHUNK ? BLOCK_CHUNK : ctx->block_size;
+	size_t block_prealloc = ctx->nshards == 1 ? block_chunk / ctx->block_size : 0;
+	for (int i = 0; i < ctx->nshards; ++i) {
+		char ** names = &ctx->shard_names[SHARD_NAMES(ctx) * i];
+		int node = ctx->nshards > 1 ? ctx->affinity.nodes[i].id : -1;
+		if (node != -1) {
+			if (asprintf(&names[0], "hash%d", node) == -1) names[0] = NULL;
+			if (asprintf(&names[1], "blocks%d", node) == -1) names[1] = NULL;
+		}
+		pool_init(&ctx->block_pools[i], names[1] ? names[1] : "blocks",
+		          ctx->block_size, block_chunk, block_prealloc, pool_flags);
+
+		for (int class = 0; class < ctx->run_classes; ++class) {
+			char ** name = &names[2 + class];
+			size_t run_size = run_class_blocks(ctx, class) * ctx->block_size;
+			size_t run_chunk = run_size < BLOCK_CHUNK ? BLOCK_CHUNK / run_size * run_size : run_size;
+			int res = 0;
+			if (class < ctx->run_classes - 1 && node != -1)
+				res = asprintf(name, "runs%d of %zu blocks", node, run_class_blocks(ctx, class));
+			else if (class < ctx->run_classes - 1)
+				res = asprintf(name, "runs of %zu blocks", run_class_blocks(ctx, class));
+			else if (node != -1)
+				res = asprintf(name, "runs%d", node);
+			if (res == -1) *name = NULL;
+			pool_init(&ctx->run_pools[ctx->run_classes * i + class], *name ? *name : "runs",
+			          run_size, run_chunk, 0, pool_flags | POOL_UNCACHED);
+		}
+	}
+	pool_init(&ctx->run_desc_pool, "run descriptors", sizeof(run_t), DESCRIPTOR_CHUNK, 0, 0);
+	pool_init(&ctx->hash_pool, "hash tasks", sizeof(hash_t), DESCRIPTOR_CHUNK, 0, 0);
+	pool_init(&ctx->file_pool, "file tasks", sizeof(file_t), DESCRIPTOR_CHUNK, 0, 0);
+
+	iosched_init(&ctx->iosched, (iosched_policy_t)options->device_policy);
+
+	pthread_mutex_init(&ctx->mutex, NULL);
+	pthread_cond_init(&ctx->done, NULL);
+
+	int uring_err = 0;
+	if (options->use_uring) {
+		uring_t ring;
+		if (uring_init(&ring, options->io_depth) == -1) {
+			uring_err = errno;
+		} else {
+			uring_free(&ring);
+			ctx->use_uring = 1;
+			/* one thread is plenty, unless asked otherwise */
+			if (!options->file_threads) file_threadnum = 1;
+			/* registered buffers, one chunk so that it is one iovec:
+			 * reads in flight plus as many waiting to be hashed */
+			size_t buffers = 2 * options->io_depth * file_threadnum;
+			if (buffers > URING_BUFFER_MEMORY / ctx->block_size)
+				buffers = URING_BUFFER_MEMORY / ctx->block_size;
+			pool_init(&ctx->uring_pool, "io_uring buffers", ctx->block_size, buffers * ctx->block_size,
+			          buffers, pool_flags | POOL_FIXED);
+		}
+	}
+
+	ctx->file_threadnum = file_threadnum;
+	ctx->extent_threadnum = ctx->use_uring ? 0 : options->readers_per_file - 1;
+	ctx->file_threads = xmalloc(sizeof(pthread_t) * file_threadnum);
+	ctx->extent_threads = xmalloc(sizeof(pthread_t) * ctx->extent_threadnum);
+	ctx->hash_threads = xmalloc(sizeof(pthread_t) * ctx->hash_threadnum);
+	if (!ctx->file_threads || (ctx->extent_threadnum && !ctx->extent_threads) || !ctx->hash_threads) goto fail;
+
+	/* initialize queues */
+	int res = 0;
+	if (options->disk_order) res |= queue_init(&ctx->order_queue, QUEUE_SIZE);
+	res |= queue_init(&ctx->file_queue, QUEUE_SIZE);
+	for (int i = 0; i < ctx->nshards; ++i)
+		res |= queue_init(&ctx->hash_queues[i], QUEUE_SIZE / ctx->nshards);
+	res |= queue_init(&ctx->output_queue, QUEUE_SIZE);
+	res |= queue_init(&ctx->extent_queue, file_threadnum * options->readers_per_file);
+	if (res) goto fail;
+
+	ctx->scanner = scan_create(options->scan_threads, scan_found_file, scan_error, ctx);
+	if (ctx->scanner == NULL) goto fail;
+
+	/* nothing can fail from here on; what can't be used is reported
+	 * through on_error once the output thread runs */
+	if (uring_err)
+		report(ctx, "io_uring", "not available, using reader threads", uring_err);
+
+	/* the cache holds hashes of the default tree only */
+	if (options->cache_path && (ctx->block_size != FASTSUM_BLOCK_SIZE || options->fanout != 0)) {
+		report(ctx, options->cache_path, "checksum cache is only for the default block size and fanout, not using it", 0);
+	} else if (options->cache_path) {
+		if (cache_open(&ctx->cache, options->cache_path) == -1) {
+			report(ctx, options->cache_path, "checksum cache not used", errno);
+		} else {
+			ctx->use_cache = 1;
+			if (ctx->cache.readonly)
+				report(ctx, options->cache_path, "checksum cache is in use, not updating it", 0);
+		}
+	}
+
+	if (options->disk_order) stats_add_queue("order", &ctx->order_queue);
+	stats_add_queue("file", &ctx->file_queue);
+	for (int i = 0; i < ctx->nshards; ++i) {
+		char * name = ctx->shard_names[SHARD_NAMES(ctx) * i];
+		stats_add_queue(name ? name : "hash", &ctx->hash_queues[i]);
+	}
+	stats_add_queue("output", &ctx->output_queue);
+
+	/* initialize workers; with --affinity, readers are spread over the
+	 * nodes, and hash workers get a CPU each */
+	for (int i = 0; i < file_threadnum; ++i)
+		start_worker(ctx, &ctx->file_threads[i], ctx->use_uring ? uring_worker : file_worker,
+		             i % ctx->nshards, 0, "fastsum-filew", ctx->use_uring ? "io_uring" : "file");
+
+	/* helpers for big files, shared by all big files being read */
+	for (int i = 0; i < ctx->extent_threadnum; ++i)
+		start_worker(ctx, &ctx->extent_threads[i], extent_worker, i % ctx->nshards, 0, "fastsum-extw", "extent");
+
+	for (int i = 0; i < ctx->hash_threadnum; ++i)
+		start_worker(ctx, &ctx->hash_threads[i], hash_worker, i % ctx->nshards, 1, "fastsum-hashw", "hash");
+
+	if (options->disk_order) {
+		pthread_create(&ctx->order_thread, NULL, order_worker, ctx);
+		pthread_setname_np(ctx->order_thread, "fastsum-ordw");
+		stats_add_thread("order", ctx->order_thread);
+	}
+
+	pthread_create(&ctx->output_thread, NULL, output_worker, ctx);
+	pthread_setname_np(ctx->output_thread, "fastsum-outw");
+	stats_add_thread("output", ctx->output_thread);
+
+	return ctx;
+
+fail:
+	fastsum_free(ctx);
+	errno = ENOMEM;
+	return NULL;
+}
+
+int fastsum_submit_path (fastsum_t * ctx, char const * path, void * tag)
+{
+	struct stat st;
+
+	file_t * file = file_alloc(ctx, tag);
+	if (file == NULL) return -1;
+	file->path = strdup(path);
+	if (file->path == NULL) {
+		pool_free(&ctx->file_pool, file);
+		return -1;
+	}
+
+	/* strip trailing slash(es) */
+	size_t len = strlen(file->path);
+	while (len > 1 && file->path[len - 1] == '/') file->path[--len] = 0;
+
+	if (stat(file->path, &st) == -1) {
+		/* errors go through the output thread too */
+		file_fail(file, errno);
+		file_post(ctx, &ctx->output_queue, file);
+	} else if ((st.st_mode & S_IFMT) == S_IFDIR) {
+		if (!ctx->scanned) ctx->scanned = 1;
+		scan_add_directory(ctx->scanner, file->path, tag);
+		free(file->path);
+		pool_free(&ctx->file_pool, file);
+	} else {
+		file_post_path(ctx, file);
+	}
+	return 0;
+}
+
+int fastsum_submit_file (fastsum_t * ctx, char const * path, void * tag)
+{
+	file_t * file = file_alloc(ctx, tag);
+	if (file == NULL) return -1;
+	file->path = strdup(path);
+	if (file->path == NULL) {
+		pool_free(&ctx->file_pool, file);
+		return -1;
+	}
+
+	file_post_path(ctx, file);
+	return 0;
+}
+
+int fastsum_submit_fd (fastsum_t * ctx, int fd, char const * name, void * tag)
+{
+	file_t * file = file_alloc(ctx, tag);
+	if (file == NULL) return -1;
+	file->path = strdup(name);
+	if (file->path == NULL) {
+		pool_free(&ctx->file_pool, file);
+		return -1;
+	}
+
+	file->fd = fd;
+	file_post(ctx, &ctx->file_queue, file);
+	return 0;
+}
+
+int fastsum_submit_buffer (fastsum_t * ctx, void const * data, size_t size,
+                           char const * name, void * tag)
+{
+	file_t * file = file_alloc(ctx, tag);
+	if (file == NULL) return -1;
+	file->path = strdup(name);
+	if (file->path == NULL) {
+		pool_free(&ctx->file_pool, file);
+		return -1;
+	}
+
+	/* an empty buffer still needs to be told apart from a path */
+	file->buffer = size ? data : "";
+	file->size = size;
+	file_post(ctx, &ctx->file_queue, file);
+	return 0;
+}
+
+void fastsum_wait (fastsum_t * ctx)
+{
+	/* once the directories are walked, all their files are posted */
+	scan_wait(ctx->scanner);
+	if (ctx->scanned && !stats.scan_ns)
+		stats.scan_ns = stats_clock() - ctx->started;
+
+	pthread_mutex_lock(&ctx->mutex);
+	ctx->waiting += 1;
+	while (ctx->files_done < ctx->files_posted)
+		pthread_cond_wait(&ctx->done, &ctx->mutex);
+	ctx->waiting -= 1;
+	pthread_mutex_unlock(&ctx->mutex);
+}
+
+void fastsum_cancel (fastsum_t * ctx)
+{
+	ctx->cancelled = 1;
+}
+
+void fastsum_print_stats (fastsum_t * ctx, FILE * out)
+{
+	for (int i = 0; i < ctx->nshards; ++i) {
+		pool_print_stats(&ctx->block_pools[i], out);
+		for (int class = 0; class < ctx->run_classes; ++class)
+			pool_print_stats(&ctx->run_pools[ctx->run_classes * i + class], out);
+	}
+	pool_print_stats(&ctx->run_desc_pool, out);
+	pool_print_stats(&ctx->hash_pool, out);
+	pool_print_stats(&ctx->file_pool, out);
+	if (ctx->use_uring) pool_print_stats(&ctx->uring_pool, out);
+	budget_print_stats(&ctx->budget, out);
+}
+
+void fastsum_destroy (fastsum_t * ctx)
+{
+	fastsum_wait(ctx);
+
+	/* the cache has all results now; what goes wrong closing it is
+	 * reported like the rest */
+	if (ctx->use_cache && cache_close(&ctx->cache) == -1) {
+		report(ctx, ctx->options.cache_path, "checksum cache not updated", errno);
+		fastsum_wait(ctx);
+	}
+	scan_finish(ctx->scanner);
+
+	/* stop queues */
+	if (ctx->options.disk_order) {
+		queue_stop(&ctx->order_queue);
+		pthread_join(ctx->order_thread, NULL);
+	}
+	queue_stop(&ctx->file_queue);
+	for (int i = 0; i < ctx->nshards; ++i)
+		queue_stop(&ctx->hash_queues[i]);
+	queue_stop(&ctx->output_queue);
+
+	for (int i = 0; i < ctx->file_threadnum; ++i)
+		pthread_join(ctx->file_threads[i], NULL);
+	/* file workers may be waiting for extent workers until now */
+	queue_stop(&ctx->extent_queue);
+	for (int i = 0; i < ctx->extent_threadnum; ++i)
+		pthread_join(ctx->extent_threads[i], NULL);
+	for (int i = 0; i < ctx->hash_threadnum; ++i)
+		pthread_join(ctx->hash_threads[i], NULL);
+	pthread_join(ctx->output_thread, NULL);
+
+	fastsum_free(ctx);
+}
@@ -0,0 +1,117 @@
+#ifndef __FASTSUM_H__
+#define __FASTSUM_H__
+
+#include <stddef.h>
+#include <stdio.h>
+
+/* libfastsum: the two-level SHA256 pipeline as a library.
+ *
+ * A context owns the worker threads (directory scanners, file readers,
+ * hash workers and the output thread), the queues between them, the
+ * memory pools and budget, and optionally a checksum cache. It lives as
+ * long as the application wants; work is submitted to it from any number
+ * of threads at once, and every submitted file comes back through exactly
+ * one of the two callbacks.
+ *
+ * The callbacks are called from the context's output thread, one at a
+ * time. They should return quickly and must not submit more work or wait
+ * for the context (the output thread is what the waiting waits for), but
+ * they may call fastsum_cancel. */
+
+/* the library is built with hidden visibility; this is all it exports */
+#define FASTSUM_API __attribute__((visibility("default")))
+
+#define FASTSUM_HASH_SIZE 32
+
+/* the hash is a tree: SHA256 of every block of the file, then of groups
+ * of `fanout` of those, and so on up to a level that has at most `fanout`
+ * hashes, which are hashed into the result. fanout 0 means no limit, so
+ * that the tree has two levels. the block size is a multiple of the
+ * minimum */
+#define FASTSUM_BLOCK_SIZE (16 * 1024)
+#define FASTSUM_MIN_BLOCK_SIZE 1024
+#define FASTSUM_MAX_BLOCK_SIZE (64 * 1024 * 1024)
+
+typedef struct fastsum fastsum_t;
+
+/* `hash` is FASTSUM_HASH_SIZE bytes; `name` is the path (or the name given
+ * with an fd or buffer), `tag` what the file was submitted with */
+typedef void (*fastsum_result_fn) (char const * name, char const * hash, void * tag, void * arg);
+/* `err` is the errno value behind `error`, 0 for errors of fastsum's own
+ * (a file that changed while being read, ...), ECANCELED for files dropped
+ * by fastsum_cancel. problems that are not with a submitted file come
+ * with a NULL tag: `name` is the checksum cache, a file whose L1 hash
+ * sidecar can't be written, ..., and `error` says what is done about it */
+typedef void (*fastsum_error_fn) (char const * name, char const * error, int err, void * tag, void * arg);
+
+/* device_policy */
+enum { FASTSUM_DEVICE_AUTO, FASTSUM_DEVICE_HDD, FASTSUM_DEVICE_SSD };
+
+typedef struct fastsum_options {
+	size_t block_size;
+	unsigned fanout;
+
+	int hash_threads;
+	int file_threads;	/* 0: 16 reader threads, or 1 io_uring thread */
+	int scan_threads;
+	size_t bigfile_limit;
+	int readers_per_file;
+	int device_policy;
+	size_t disk_order;	/* read files given by path in the order of their
+				 * data on disk, sorting up to this many at a
+				 * time. 0: in the order they are found */
+	int use_uring;		/* falls back to reader threads if unavailable */
+	int io_depth;
+	size_t read_size;	/* bytes read from a file at once, whole blocks */
+	size_t readahead;	/* bytes read ahead in big files, 0: kernel's own */
+	int no_cache;		/* don't leave what was read in the page cache */
+	size_t max_memory;	/* 0: no limit */
+	int hugepages;
+	int affinity;		/* pin workers, keep blocks on their NUMA node */
+	char const * cache_path;	/* NULL: no checksum cache. only used with
+					 * the default block size and fanout */
+	char const * digests_path;	/* NULL: no L1 hash sidecars of big files */
+	int digests_extents;	/* reuse hashes of unchanged extents (btrfs) */
+
+	fastsum_result_fn on_result;
+	fastsum_error_fn on_error;
+	void * arg;		/* passed to the callbacks */
+} fastsum_options_t;
+
+/* the defaults of the fastsum command */
+FASTSUM_API void fastsum_options_init (fastsum_options_t * options);
+
+/* start the threads. returns NULL and errno if that fails: EINVAL if the
+ * block size or fanout is invalid, ENOMEM if out of memory */
+FASTSUM_API fastsum_t * fastsum_create (fastsum_options_t const * options);
+
+/* All submit functions may block while the context is busy, and return 0,
+ * or -1 and errno if the work could not be queued (no callback follows). */
+
+/* a file, or a directory to be walked recursively; every file in it is
+ * reported with `tag` */
+FASTSUM_API int fastsum_submit_path (fastsum_t * ctx, char const * path, void * tag);
+/* a single file; directories are reported as errors */
+FASTSUM_API int fastsum_submit_file (fastsum_t * ctx, char const * path, void * tag);
+/* an open file, which must stay open until its callback. a regular file is
+ * read from offset 0 by pread; a pipe, socket or terminal is read to the
+ * end like a stream, hashed as it comes */
+FASTSUM_API int fastsum_submit_fd (fastsum_t * ctx, int fd, char const * name, void * tag);
+/* `size` bytes of memory, which must stay valid until the callback */
+FASTSUM_API int fastsum_submit_buffer (fastsum_t * ctx, void const * data, size_t size,
+                                       char const * name, void * tag);
+
+/* wait until everything submitted so far has gone through the callbacks */
+FASTSUM_API void fastsum_wait (fastsum_t * ctx);
+/* stop reading; files still queued or in flight are reported to on_error
+ * with ECANCELED, and no more results are delivered. this is for good:
+ * anything submitted later is cancelled as well */
+FASTSUM_API void fastsum_cancel (fastsum_t * ctx);
+
+/* memory pool and budget statistics */
+FASTSUM_API void fastsum_print_stats (fastsum_t * ctx, FILE * out);
+
+/* wait, stop the threads and free everything */
+FASTSUM_API void fastsum_destroy (fastsum_t * ctx);
+
+#endif
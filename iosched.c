@@ -0,0 +1,201 @@
+#include <fcntl.h>
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <linux/fiemap.h>
+#include <linux/fs.h>
+#include <sys/ioctl.h>
+#include <sys/stat.h>
+#include <sys/sysmacros.h>
+
+#include "iosched.h"
+#include "tools.h"
+
+/* rotational flag from sysfs; partitions keep it in their parent disk.
+ * devices without a queue (tmpfs, btrfs, nfs, ...) count as non-rotational */
+static int is_rotational (dev_t dev)
+{
+	static char const * const formats[] = {
+		"/sys/dev/block/%u:%u/queue/rotational",
+		"/sys/dev/block/%u:%u/../queue/rotational",
+	};
+	char path[64];
+
+	for (int i = 0; i < 2; ++i) {
+		snprintf(path, sizeof(path), formats[i], major(dev), minor(dev));
+		FILE * f = fopen(path, "r");
+		if (f == NULL) continue;
+		int c = fgetc(f);
+		fclose(f);
+		return c == '1';
+	}
+	return 0;
+}
+
+void iosched_init (iosched_t * sched, iosched_policy_t policy)
+{
+	pthread_mutex_init(&sched->mutex, NULL);
+	sched->policy = policy;
+	sched->devices = NULL;
+}
+
+void iosched_free (iosched_t * sched)
+{
+	while (sched->devices) {
+		io_device_t * device = sched->devices;
+		sched->devices = device->next;
+		pthread_rwlock_destroy(&device->lock);
+		pthread_cond_destroy(&device->unparked);
+		free(device->parked);
+		free(device);
+	}
+	pthread_mutex_destroy(&sched->mutex);
+}
+
+io_device_t * iosched_device (iosched_t * sched, dev_t dev)
+{
+	pthread_mutex_lock(&sched->mutex);
+
+	/* there are only ever a handful */
+	io_device_t * device = sched->devices;
+	while (device && device->dev != dev) device = device->next;
+
+	if (device == NULL) {
+		device = xmalloc(sizeof(io_device_t));
+		if (device == NULL) goto done;
+		device->dev = dev;
+		if (sched->policy == IOSCHED_AUTO)
+			device->rotational = is_rotational(dev);
+		else
+			device->rotational = sched->policy == IOSCHED_HDD;
+		device->max_workers = device->rotational ? IOSCHED_HDD_WORKERS : INT_MAX;
+		pthread_cond_init(&device->unparked, NULL);
+
+		/* a waiting big file goes before new small ones */
+		pthread_rwlockattr_t attr;
+		pthread_rwlockattr_init(&attr);
+		pthread_rwlockattr_setkind_np(&attr, PTHREAD_RWLOCK_PREFER_WRITER_NONRECURSIVE_NP);
+		pthread_rwlock_init(&device->lock, &attr);
+		pthread_rwlockattr_destroy(&attr);
+
+		device->next = sched->devices;
+		sched->devices = device;
+	}
+
+done:
+	pthread_mutex_unlock(&sched->mutex);
+	return device;
+}
+
+int iosched_enter (iosched_t * sched, io_device_t * device, void * item)
+{
+	int enter = 0;
+
+	pthread_mutex_lock(&sched->mutex);
+	/* the device's readers take parked files out, and wake us */
+	while (device->workers >= device->max_workers && device->parked_count >= IOSCHED_MAX_PARKED)
+		pthread_cond_wait(&device->unparked, &sched->mutex);
+	if (device->workers >= device->max_workers && device->parked_count == device->parked_capacity) {
+		/* unwrap the ring into the bigger array */
+		size_t capacity = device->parked_capacity ? 2 * device->parked_capacity : 64;
+		void ** parked = xmalloc(capacity * sizeof(void *));
+		if (parked) {
+			for (size_t i = 0; i < device->parked_count; ++i)
+				parked[i] = device->parked[(device->parked_head + i) % device->parked_capacity];
+			free(device->parked);
+			device->parked = parked;
+			device->parked_capacity = capacity;
+			device->parked_head = 0;
+		}
+	}
+	/* without the memory to park the item, it is read now all the same */
+	if (device->workers < device->max_workers || device->parked_count == device->parked_capacity) {
+		device->workers += 1;
+		enter = 1;
+	} else {
+		size_t tail = (device->parked_head + device->parked_count) % device->parked_capacity;
+		device->parked[tail] = item;
+		device->parked_count += 1;
+	}
+	pthread_mutex_unlock(&sched->mutex);
+
+	return enter;
+}
+
+void * iosched_next (iosched_t * sched, io_device_t * device)
+{
+	void * item = NULL;
+
+	pthread_mutex_lock(&sched->mutex);
+	if (device->parked_count) {
+		item = device->parked[device->parked_head];
+		device->parked_head = (device->parked_head + 1) % device->parked_capacity;
+		device->parked_count -= 1;
+	} else {
+		device->workers -= 1;
+	}
+	/* either way there is room for one more file */
+	pthread_cond_signal(&device->unparked);
+	pthread_mutex_unlock(&sched->mutex);
+
+	return item;
+}
+
+void iosched_begin_read (io_device_t * device, int big)
+{
+	if (!device->rotational) return;
+	if (big)
+		pthread_rwlock_wrlock(&device->lock);
+	else
+		pthread_rwlock_rdlock(&device->lock);
+}
+
+void iosched_end_read (io_device_t * device, int big)
+{
+	if (device->rotational) pthread_rwlock_unlock(&device->lock);
+}
+
+void iosched_locate (iosched_order_t * order, char const * path)
+{
+	struct stat st;
+	/* room for one extent */
+	uint64_t map[(sizeof(struct fiemap) + sizeof(struct fiemap_extent)) / sizeof(uint64_t)];
+	struct fiemap * fm = (struct fiemap *)map;
+
+	order->dev = 0;
+	order->position = 0;
+	if (stat(path, &st) == -1 || !S_ISREG(st.st_mode)) return;
+	order->dev = st.st_dev;
+	if (st.st_size == 0) return;
+
+	int fd = open(path, O_RDONLY | O_NOCTTY);
+	if (fd == -1) return;
+	memset(map, 0, sizeof(map));
+	fm->fm_length = FIEMAP_MAX_OFFSET;
+	fm->fm_extent_count = 1;
+	if (ioctl(fd, FS_IOC_FIEMAP, fm) == -1) {
+		order->position = st.st_ino;
+	} else if (fm->fm_mapped_extents == 1) {
+		/* not yet written out, or kept in the inode: nowhere to go */
+		if (!(fm->fm_extents[0].fe_flags & (FIEMAP_EXTENT_UNKNOWN | FIEMAP_EXTENT_DATA_INLINE)))
+			order->position = fm->fm_extents[0].fe_physical;
+	}
+	close(fd);
+}
+
+static int order_cmp (void const * a, void const * b)
+{
+	iosched_order_t const * x = a;
+	iosched_order_t const * y = b;
+	if (x->dev != y->dev) return x->dev < y->dev ? -1 : 1;
+	if (x->position != y->position) return x->position < y->position ? -1 : 1;
+	return 0;
+}
+
+void iosched_sort (iosched_order_t * orders, size_t count)
+{
+	qsort(orders, count, sizeof(iosched_order_t), order_cmp);
+}
@@ -0,0 +1,86 @@
+#ifndef __IOSCHED_H__
+#define __IOSCHED_H__
+
+#include <pthread.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/types.h>
+
+/* Per-device read scheduling. Files are grouped by st_dev and every
+ * device gets a policy of its own:
+ *
+ * - rotational disks (sysfs queue/rotational) are read by at most
+ *   IOSCHED_HDD_WORKERS threads at once, and a big file is read alone
+ *   and sequentially, so that the heads don't jump around
+ * - anything else (SSD, NVMe, tmpfs, network, ...) is read by as many
+ *   threads as there are, big files included
+ *
+ * A thread that gets a file for a device that is already busy enough
+ * parks the file with the device and moves on to other files; whoever
+ * finishes a read on that device picks it up later. So a slow disk only
+ * ties up its own share of the reader threads. */
+
+#define IOSCHED_HDD_WORKERS 2
+/* files parked with a device at most; more wait until there is room, so
+ * a directory walk is not pulled into memory behind a slow disk */
+#define IOSCHED_MAX_PARKED (16 * 1024)
+
+/* device policy override */
+typedef enum { IOSCHED_AUTO, IOSCHED_HDD, IOSCHED_SSD } iosched_policy_t;
+
+typedef struct io_device {
+	dev_t dev;
+	int rotational;
+	int max_workers;
+	int workers;		/* threads reading from it, guarded by iosched mutex */
+
+	/* files waiting for a worker, FIFO */
+	void ** parked;
+	size_t parked_capacity;
+	size_t parked_head;
+	size_t parked_count;
+	pthread_cond_t unparked;	/* a parked file or a reader slot was freed */
+
+	/* rotational: big files hold it exclusively, small ones shared */
+	pthread_rwlock_t lock;
+
+	struct io_device * next;
+} io_device_t;
+
+typedef struct iosched {
+	pthread_mutex_t mutex;
+	iosched_policy_t policy;
+	io_device_t * devices;
+} iosched_t;
+
+void iosched_init (iosched_t * sched, iosched_policy_t policy);
+void iosched_free (iosched_t * sched);
+/* find the device, detecting its policy the first time it is seen. NULL
+ * if out of memory */
+io_device_t * iosched_device (iosched_t * sched, dev_t dev);
+/* returns 1 if the caller should read `item` now, 0 if it was parked.
+ * blocks while the device has IOSCHED_MAX_PARKED files parked */
+int iosched_enter (iosched_t * sched, io_device_t * device, void * item);
+/* the caller finished reading from `device`. returns a parked item for the
+ * caller to read next (it keeps its place), or NULL */
+void * iosched_next (iosched_t * sched, io_device_t * device);
+/* bracket the actual reads of one file */
+void iosched_begin_read (io_device_t * device, int big);
+void iosched_end_read (io_device_t * device, int big);
+
+/* Disk order: files sorted by device and by where their data starts on
+ * it are read in one sweep across the disk, rather than in directory
+ * order, which seeks back and forth between them. */
+typedef struct iosched_order {
+	dev_t dev;
+	uint64_t position;
+	void * item;
+} iosched_order_t;
+
+/* where the data of the file at `path` starts: the physical address of its
+ * first extent (FIEMAP), or its inode number where the filesystem can't
+ * tell. files without data, and anything but regular files, come first */
+void iosched_locate (iosched_order_t * order, char const * path);
+void iosched_sort (iosched_order_t * orders, size_t count);
+
+#endif
@@ -1,427 +1,451 @@
-#include <assert.h>
-#include <dirent.h>
 #include <errno.h>
-#include <fcntl.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
-#include <time.h>
-#include <unistd.h>
-
-#include <sys/types.h>
-#include <sys/stat.h>
-#include <sys/sysinfo.h>
 
 #include <stdatomic.h>
-#include <pthread.h>
 
 #include <getopt.h>
 
+#include "fastsum.h"
 #include "sha256.h"
-#include "queue.h"
+#include "stats.h"
 #include "tools.h"
 
-#define BLOCKSIZE (16 * 1024)
-#define QUEUE_SIZE (16 * 1024)
-
-#define BIGFILE_LIMIT (256 * 1024)
-
-/* task types */
-typedef enum { FILE_TASK, HASH_TASK } task_type;
-
-/* file task */
-typedef enum { STARTED, POSTED, L1DONE } state_t;
-
-
-typedef struct {
-	task_type type;
-	
-	char * path;
-	uint64_t size;
-
-	char * l1hashes;
-	size_t l1hashes_size;
-
-	/* size of max acceptable file is limited
-	 * by the l1hashes field; we would have to
-	 * add another level if we wanted to support
-	 * huge files on 32bit archs. hence size_t
-	 * is appropriate for counting numbers of work
-	 * units as well */
-	size_t work_posted;
-	size_t work_completed;
-
-	state_t state;
-	char const * error;
-
-	char result[HASH_SIZE];
-} file_t;
-
-
-/* hash task */
-typedef struct {
-	task_type type;
-
-	char* result;
-	char* data;
-	size_t length;
-	file_t * file;
-} hash_t;
+/* the command line client of libfastsum */
 
-/* completion task */
-typedef union {
-	task_type type;
-	file_t file;
-	hash_t hash;
-} completion_t;
+/* a context per tree shape: one when computing, in verify mode as many as
+ * the manifest has (it could mix them) */
+#define MAX_SHAPES 8
 
+/* files sorted at a time by --disk-order */
+#define DISK_ORDER 4096
 
-/* queues */
+typedef struct shape {
+	size_t block_size;
+	unsigned fanout;
+	fastsum_t * ctx;
+} shape_t;
 
-queue_t file_queue;
-queue_t hash_queue;
-queue_t completed_queue;
+fastsum_options_t options;
+shape_t shapes[MAX_SHAPES];
+int nshapes = 0;
 
-_Atomic int directories_enqueued = ATOMIC_VAR_INIT(0);
-_Atomic int files_done = ATOMIC_VAR_INIT(0);
-_Atomic int files_posted = ATOMIC_VAR_INIT(0);
-
-pthread_mutex_t bigfile_mutex = PTHREAD_MUTEX_INITIALIZER;
-int bigfile_limit = BIGFILE_LIMIT;
-
-
-/* worker threads */
-
-void do_process_file (file_t *, off_t size);
-
-void * file_worker (void * unused)
+/* returns NULL and errno if the shape is invalid or there are too many */
+fastsum_t * context_for (size_t block_size, unsigned fanout)
 {
-	struct stat st;
-
-	for (;;) {
-		file_t * file = queue_pop(&file_queue);
-		if (file == NULL) return NULL;
+	for (int i = 0; i < nshapes; ++i)
+		if (shapes[i].block_size == block_size && shapes[i].fanout == fanout)
+			return shapes[i].ctx;
 
-		int res = stat(file->path, &st);
-		if (res == -1) {
-			file->error = strerror(errno);
-			queue_push(&completed_queue, file);
-			continue;
-		}
-
-		int mode = st.st_mode & S_IFMT;
-		if (mode == S_IFREG) {
-			do_process_file(file, st.st_size);
-		} else {
-			file->error = "Not a regular file";
-			queue_push(&completed_queue, file);
-			continue;
-		}
+	if (nshapes == MAX_SHAPES) {
+		errno = EMFILE;
+		return NULL;
 	}
+	shape_t * shape = &shapes[nshapes];
+	fastsum_options_t shape_options = options;
+	shape_options.block_size = block_size;
+	shape_options.fanout = fanout;
+	shape_options.arg = shape;
+
+	shape->ctx = fastsum_create(&shape_options);
+	if (shape->ctx == NULL) return NULL;
+	shape->block_size = block_size;
+	shape->fanout = fanout;
+	nshapes += 1;
+	return shape->ctx;
 }
 
-void * hash_worker (void * unused)
-{
-	for (;;) {
-		hash_t * hash = queue_pop(&hash_queue);
-		if (hash == NULL) return NULL;
+/* verify mode results */
+_Atomic int verify_ok = ATOMIC_VAR_INIT(0);
+_Atomic int verify_failed = ATOMIC_VAR_INIT(0);
+_Atomic int verify_missing = ATOMIC_VAR_INIT(0);
+int fail_fast = 0;
+_Atomic int stop_requested = ATOMIC_VAR_INIT(0);
 
-		sha256_hash_block(hash->data, hash->length, hash->result);
-		queue_push(&completed_queue, hash);
-	}
-}
 
-void do_complete_file_l1 (file_t*);
-void do_complete_file_l2 (file_t*);
+/* callbacks, called from the output thread so that nothing gets interleaved */
 
-void * completion_worker (void * unused)
+void verify_failure (char const * name, char const * what)
 {
-	for (;;) {
-		completion_t * task = queue_pop(&completed_queue);
-		if (task == NULL) return NULL;
-
-		if (task->type == HASH_TASK) {
-			hash_t * hash = &task->hash;
-			file_t * file = hash->file;
-
-			if (file->state != L1DONE) free(hash->data);
-				/* because at L1DONE it points to l1hashes which is freed later */
-			free(hash);
-			
-			file->work_completed += 1;
-			switch (file->state) {
-				case POSTED:
-					if (file->work_completed == file->work_posted)
-						do_complete_file_l1(file);
-					break;
-				case L1DONE:
-					do_complete_file_l2(file);
-					break;
-				case STARTED:
-					/* nothing */
-					break;
-			}
-
-		} else if (task->type == FILE_TASK) {
-			file_t * file = &task->file;
-			if (file->state != STARTED) {
-				fprintf(stderr, "While processing %s: invalid state of file in queue\n", file->path);
-				/* not sure what to do now, just pretend that nothing happened i guess */
-				continue;
-			}
-
-			file->state = POSTED;
-			if (file->work_completed == file->work_posted)
-				do_complete_file_l1(file);
-		}
+	printf("%s: %s\n", name, what);
+	if (fail_fast && !atomic_exchange(&stop_requested, 1)) {
+		for (int i = 0; i < nshapes; ++i)
+			fastsum_cancel(shapes[i].ctx);
 	}
 }
 
-
-/* auxilliary functions */
-
-void file_dealloc (file_t * file)
+/* "b=BLOCKSIZE,f=FANOUT:" before the hash, unless it is the classic one */
+int format_shape (char * out, shape_t const * shape)
 {
-	free(file->l1hashes);
-	free(file->path);
-	free(file);
-
-	files_done += 1;
+	if (shape->block_size == FASTSUM_BLOCK_SIZE && shape->fanout == 0) return 0;
+	return sprintf(out, "b=%zu,f=%u:", shape->block_size, shape->fanout);
 }
 
-void do_process_file (file_t * file, off_t size)
+/* in verify mode, the tag is the expected hash */
+void print_result (char const * name, char const * hash, void * expected, void * shape)
 {
-	int err_flag = 1;
-	int work_posted = 0;
-	int fd = -1;
-	char * data = NULL;
-
-	/* enter "bigfile" crit section */
-	pthread_mutex_lock(&bigfile_mutex);
-	/* if this is not big file, leave immediately */
-	if (size < bigfile_limit) pthread_mutex_unlock(&bigfile_mutex);
-
-	/* simplistic read()ing */
-	fd = open(file->path, O_RDONLY);
-	if (fd == -1) goto end;
-
-	file->size = size;
-	uint64_t chunks = file->size / BLOCKSIZE;
-	assert(chunks <= SIZE_MAX);
-	if (file->size % BLOCKSIZE) chunks += 1;
-
-	file->l1hashes = malloc(chunks * HASH_SIZE);
-	if (file->l1hashes == NULL) goto end;
-	
-	char * resultptr = file->l1hashes;
-	for (;;) {
-		data = malloc(BLOCKSIZE);
-		if (data == NULL) goto end;
-		ssize_t bytes_read = read(fd, data, BLOCKSIZE);
-		/* todo handle errors correctly, take care of EINTR */
-		if (bytes_read == -1) goto end;
-
-		/* filesize is multiple of BLOCKSIZE and eof happened */
-		if (!bytes_read) break;
-
-		if (work_posted == chunks) {
-			/* unexpected successful read over limit */
-			/* set custom error */
-			file->error = "File grew while hashing";
-			goto end;
+	if (expected) {
+		if (!memcmp(hash, expected, HASH_SIZE)) {
+			verify_ok += 1;
+			printf("%s: OK\n", name);
+		} else {
+			verify_failed += 1;
+			verify_failure(name, "FAILED");
 		}
+		free(expected);
+		return;
+	}
 
-		hash_t * hash = malloc(sizeof(hash_t));
-		if (hash == NULL) goto end;
-
-		hash->type = HASH_TASK;
-		hash->file = file;
-
-		hash->result = resultptr;
-		hash->data = data;
-		hash->length = bytes_read;
-
-		queue_push(&hash_queue, hash);
-		work_posted += 1;
-		resultptr += HASH_SIZE;
-		data = NULL;
+	/* print hash, in one go: contexts of other shapes print too */
+	char line[64 + 2 * HASH_SIZE + 1];
+	int len = format_shape(line, shape);
+	for (int i = 0; i < HASH_SIZE; ++i)
+		len += sprintf(line + len, "%.2hhx", hash[i]);
+	printf("%s  %s\n", line, name);
+}
 
-		/* on eof, break */
-		if (bytes_read < BLOCKSIZE) break;
+void print_error (char const * name, char const * error, int err, void * expected, void * unused)
+{
+	/* --fail-fast gave up on the rest */
+	if (err == ECANCELED) {
+		free(expected);
+		return;
 	}
 
-	err_flag = 0;
-end:
-	if (err_flag) {
-		free(data);
-		if (!file->error) file->error = strerror(errno);
+	fprintf(stderr, "Error processing %s: %s\n", name, error);
+	if (expected && err == ENOENT) {
+		verify_missing += 1;
+		verify_failure(name, "MISSING");
+	} else if (expected) {
+		verify_failed += 1;
+		verify_failure(name, "FAILED open or read");
 	}
-	if (size >= bigfile_limit) pthread_mutex_unlock(&bigfile_mutex);
-	close(fd);
-	file->work_posted = work_posted;
-	file->l1hashes_size = work_posted * HASH_SIZE;
-	queue_push(&completed_queue, file);
+	free(expected);
 }
 
-void do_complete_file_l1 (file_t * file)
-{
-	if (file->error) {
-		fprintf(stderr, "Error processing %s: %s\n", file->path, file->error);
-		file_dealloc(file);
-	} else {
-		file->state = L1DONE;
+/* manifest for verify mode */
 
-		hash_t * hash = malloc(sizeof(hash_t));
-		if (hash == NULL) {
-			fprintf(stderr, "Out of memory when processing %s\n", file->path);
-			file_dealloc(file);
-			return;
+int parse_hash (char const * hex, char * hash)
+{
+	for (int i = 0; i < HASH_SIZE; ++i) {
+		int value = 0;
+		for (int j = 0; j < 2; ++j) {
+			char c = hex[2 * i + j];
+			value <<= 4;
+			if (c >= '0' && c <= '9') value |= c - '0';
+			else if (c >= 'a' && c <= 'f') value |= c - 'a' + 10;
+			else if (c >= 'A' && c <= 'F') value |= c - 'A' + 10;
+			else return -1;
 		}
-
-		hash->type = HASH_TASK;
-		hash->file = file;
-		hash->data = file->l1hashes;
-		hash->length = file->l1hashes_size;
-		hash->result = file->result;
-		queue_push(&hash_queue, hash);
+		hash[i] = value;
 	}
+	return 0;
 }
 
-void do_complete_file_l2 (file_t * file)
+/* Read "HASH  PATH" lines (fastsum's own output) and submit every path for
+ * verification, with the expected hash as its tag. Returns number of
+ * malformed lines, -1 if the manifest can't be read. */
+int do_process_manifest (char const * path)
 {
-	/* print hash */
-	for (int i = 0; i < HASH_SIZE; ++i)
-		printf("%.2hhx", file->result[i]);
-	printf("  %s\n", file->path);
-	file_dealloc(file);
-}
-
+	FILE * in = strcmp(path, "-") ? fopen(path, "r") : stdin;
+	if (in == NULL) {
+		fprintf(stderr, "%s: %s\n", path, strerror(errno));
+		return -1;
+	}
 
-/* directory enqueue function */
+	char * line = NULL;
+	size_t capacity = 0;
+	ssize_t len;
+	size_t lineno = 0;
+	int malformed = 0;
+
+	while (!stop_requested && (len = getline(&line, &capacity, in)) != -1) {
+		lineno += 1;
+		if (len && line[len - 1] == '\n') line[--len] = 0;
+		if (len == 0) continue;
+
+		char * expected = xmalloc(HASH_SIZE);
+		if (expected == NULL) {
+			fprintf(stderr, "out of memory!\n");
+			exit(13);
+		}
 
-void do_process_directory (char * path)
-{
-	DIR * dirfd;
-	struct dirent * dirent;
-	file_t * file = NULL;
-	char * newpath = NULL;
-
-	int pathlen = strlen(path);
-
-	/* TODO lock bigfile mutex for directories as well? */
-	pthread_mutex_lock(&bigfile_mutex);
-	/* we don't need to hold it */
-	pthread_mutex_unlock(&bigfile_mutex);
-
-	dirfd = opendir(path);
-	if (dirfd == NULL) goto error;
-
-	errno = 0;
-	while ((dirent = readdir(dirfd))) {
-		if (dirent->d_name[0] == '.' &&
-		     (dirent->d_name[1] == 0 ||
-		       (dirent->d_name[1] == '.' && dirent->d_name[2] == 0)
-		     )
-		   ) continue;
-
-		int len = strlen(dirent->d_name);
-		newpath = malloc(pathlen + 1 + len + 1);
-		if (newpath == NULL) goto error;
-		strncpy(newpath, path, pathlen);
-		newpath[pathlen] = '/';
-		strncpy(newpath + pathlen + 1, dirent->d_name, len);
-		newpath[pathlen + 1 + len] = 0;
-
-		if (dirent->d_type == DT_DIR) {
-			directories_enqueued += 1;
-			do_process_directory(newpath);
-			free(newpath);
-			newpath = NULL;
+		/* the tree shape if not the classic one, hash, two spaces (or space
+		 * and '*' as sha256sum writes it), path */
+		size_t block_size = FASTSUM_BLOCK_SIZE;
+		unsigned fanout = 0;
+		int start = 0;
+		if (sscanf(line, "b=%zu,f=%u:%n", &block_size, &fanout, &start) < 2) start = 0;
+
+		char * hash = line + start;
+		if (len < start + 2 * HASH_SIZE + 3
+		    || parse_hash(hash, expected) == -1
+		    || hash[2 * HASH_SIZE] != ' '
+		    || (hash[2 * HASH_SIZE + 1] != ' ' && hash[2 * HASH_SIZE + 1] != '*')) {
+			fprintf(stderr, "%s: %zu: improperly formatted line\n", path, lineno);
+			malformed += 1;
+			free(expected);
 			continue;
 		}
 
-		file = malloc(sizeof(file_t));
-		if (file == NULL) goto error;
-		memset(file, 0, sizeof(file_t));
-
-		file->type = FILE_TASK;
-		file->path = newpath;
-		file->state = STARTED;
-		queue_push(&file_queue, file);
-		files_posted += 1;
+		fastsum_t * ctx = context_for(block_size, fanout);
+		if (ctx == NULL) {
+			fprintf(stderr, "%s: %zu: can't check block size %zu, fanout %u: %s\n",
+			        path, lineno, block_size, fanout, strerror(errno));
+			malformed += 1;
+			free(expected);
+			continue;
+		}
 
-		newpath = NULL;
-		file = NULL;
+		if (fastsum_submit_file(ctx, hash + 2 * HASH_SIZE + 2, expected) == -1) {
+			fprintf(stderr, "out of memory!\n");
+			exit(13);
+		}
 	}
 
+	int error = ferror(in);
+	if (error) fprintf(stderr, "%s: %s\n", path, strerror(errno));
+	free(line);
+	if (in != stdin) fclose(in);
 
-	if (!errno) {
-		/* decrement only after processing */
-		directories_enqueued -= 1;
-		closedir(dirfd);
-		return;
-	}
+	return error ? -1 : malformed;
+}
 
-error:
-	/* decrement only after processing */
-	directories_enqueued -= 1;
-	/* print error in completion thread */
-	file_t * dir = malloc(sizeof(file_t));
-	if (dir != NULL) {
-		memset(dir, 0, sizeof(file_t));
-		dir->error = strerror(errno);
-		dir->path = strdup(path);
-		dir->state = STARTED;
-		queue_push(&completed_queue, dir);
+/* number with an optional k, M or G suffix */
+size_t parse_size (char const * arg)
+{
+	char * end;
+	size_t size = strtoull(arg, &end, 10);
+	switch (*end) {
+		case 'G': size *= 1024;	/* fall through */
+		case 'M': size *= 1024;	/* fall through */
+		case 'k': size *= 1024;
 	}
-	free(file);
-	free(newpath);
-	closedir(dirfd);
+	return size;
 }
 
 void print_usage()
 {
 	printf("Usage: fastsum [FILE]...\n"
+		"       fastsum -c MANIFEST\n"
+		"With FILE '-', read standard input (which may be a pipe).\n"
 		"Options:\n"
+		"  -c, --check=MANIFEST       verify files against a list of checksums in\n"
+		"                             fastsum's output format ('-' for stdin)\n"
+		"      --fail-fast            with -c, stop at the first failed file\n"
 		"  -w, --hash-workers=NUM     use a specified number of hash worker threads\n"
 		"                             Default: number of available CPU cores\n"
 		"  -f, --file-workers=NUM     use a specified number of file reader threads\n"
 		"                             Default: 16\n"
-		"  -b, --big=NUM              set the bigfile limit: when reading files larger\n"
-		"                             than this, other file readers will stop so that\n"
-		"                             the big file can be read continuously.\n"
+		"  -s, --scan-workers=NUM     use a specified number of directory scanner threads\n"
+		"                             Default: 4\n"
+		"  -b, --big=NUM              set the bigfile limit: on rotational disks, files\n"
+		"                             larger than this are read alone and sequentially,\n"
+		"                             elsewhere they are read by several threads (-r).\n"
 		"                             You can use 'k' and 'M' suffixes. Default: 256k\n"
+		"  -r, --readers=NUM          read each big file on a non-rotational device with\n"
+		"                             this many threads, 1 MiB extents at a time. Default: 4\n"
+		"      --block-size=NUM       hash files in blocks of this size, a multiple of 1k.\n"
+		"                             'k' and 'M' suffixes are accepted. Default: 16k\n"
+		"      --fanout=NUM           hash the block hashes in groups of NUM, and those\n"
+		"                             hashes again, until at most NUM are left, for a tree\n"
+		"                             of more than two levels. Default: 0, no limit\n"
+		"                             Either of these is noted in front of the hash as\n"
+		"                             'b=BLOCKSIZE,f=FANOUT:', which -c understands\n"
+	);
+	printf(
+		"      --device-policy=NAME   how to read from devices: 'auto' (ask sysfs if\n"
+		"                             they are rotational), 'hdd' or 'ssd'. Default: auto\n"
+		"      --disk-order[=NUM]     read files in the order their data is on disk\n"
+		"                             (FIEMAP), sorting up to NUM found files at a\n"
+		"                             time. Default NUM: 4096\n"
+		"      --kernel=NAME          SHA256 implementation: auto, scalar, shani,\n"
+		"                             armv8, avx2 or avx512. Default: auto\n"
+		"      --io=ENGINE            how files are read: 'threads' (blocking reads in\n"
+		"                             file worker threads) or 'uring' (io_uring with\n"
+		"                             many reads in flight). Default: threads\n"
+		"      --io-depth=NUM         reads in flight per io_uring thread. Default: 256\n"
+		"      --read-size=NUM        read files this much at a time, in whole blocks,\n"
+		"                             which are hashed straight from the buffer read\n"
+		"                             into. Default: 1M\n"
+		"      --readahead=NUM        read big files this far ahead of the reader, 0 to\n"
+		"                             leave it to the kernel. Default: 4M\n"
+		"      --no-cache             don't keep what was read in the page cache: drop\n"
+		"                             it behind the reader, or with --io=uring, read\n"
+		"                             with O_DIRECT where possible\n"
+		"      --cache=FILE           remember checksums in FILE and don't read files\n"
+		"                             that haven't changed since they were hashed\n"
+		"      --digests=DIR          keep the block hashes of big files in DIR, and\n"
+		"                             don't read a file again if it hasn't changed\n"
+		"      --digests-extents      with --digests, on btrfs, read only the blocks\n"
+		"                             whose extents changed since the last time\n"
+		"      --max-memory=NUM       limit memory used by data in flight; readers wait\n"
+		"                             when it runs out. 'k', 'M' and 'G' suffixes\n"
+		"                             are accepted. Default: no limit\n"
+		"      --hugepages            back data buffers by huge pages if possible\n"
+		"      --affinity             pin hash workers to a CPU each and readers to a\n"
+		"                             NUMA node, and hash blocks on the node they\n"
+		"                             were read on\n"
+		"      --pool-stats           print memory pool statistics when done\n"
+		"      --stats[=FORMAT]       print pipeline statistics to stderr when done:\n"
+		"                             throughput, queue depths and waits, CPU time per\n"
+		"                             thread, read and hash latencies. FORMAT is 'text'\n"
+		"                             (default) or 'json'\n"
+		"      --stats-interval=SECS  also print them every SECS seconds\n"
 	);
 }
 
+
 int main (int argc, char **argv)
 {
-	int hash_threadnum = get_nprocs();
-	int file_threadnum = 16;
+	fastsum_options_init(&options);
+	options.on_result = print_result;
+	options.on_error = print_error;
+
+	char const * kernel = "auto";
+	int pool_stats = 0;
+
+	/* values for options without a short form */
+	enum { OPT_KERNEL = 256, OPT_HUGEPAGES, OPT_POOL_STATS, OPT_IO, OPT_IO_DEPTH, OPT_CACHE,
+	       OPT_FAIL_FAST, OPT_DEVICE_POLICY, OPT_MAX_MEMORY, OPT_STATS, OPT_STATS_INTERVAL,
+	       OPT_BLOCK_SIZE, OPT_FANOUT, OPT_DIGESTS, OPT_DIGESTS_EXTENTS, OPT_AFFINITY,
+	       OPT_READAHEAD, OPT_NO_CACHE, OPT_DISK_ORDER, OPT_READ_SIZE };
+	stats_format_t stats_format = STATS_OFF;
+	double stats_interval = 0;
+	char const * manifest_path = NULL;
+	int manifest_status = 0;
 
 	static struct option long_opts[] = {
+		{ "check",        required_argument, 0, 'c' },
+		{ "fail-fast",    no_argument,       0, OPT_FAIL_FAST },
 		{ "hash-workers", required_argument, 0, 'w' },
 		{ "file-workers", required_argument, 0, 'f' },
+		{ "scan-workers", required_argument, 0, 's' },
 		{ "big",          required_argument, 0, 'b' },
+		{ "readers",      required_argument, 0, 'r' },
+		{ "block-size",   required_argument, 0, OPT_BLOCK_SIZE },
+		{ "fanout",       required_argument, 0, OPT_FANOUT },
+		{ "device-policy", required_argument, 0, OPT_DEVICE_POLICY },
+		{ "kernel",       required_argument, 0, OPT_KERNEL },
+		{ "io",           required_argument, 0, OPT_IO },
+		{ "io-depth",     required_argument, 0, OPT_IO_DEPTH },
+		{ "cache",        required_argument, 0, OPT_CACHE },
+		{ "digests",      required_argument, 0, OPT_DIGESTS },
+		{ "digests-extents", no_argument,    0, OPT_DIGESTS_EXTENTS },
+		{ "affinity",     no_argument,       0, OPT_AFFINITY },
+		{ "read-size",    required_argument, 0, OPT_READ_SIZE },
+		{ "readahead",    required_argument, 0, OPT_READAHEAD },
+		{ "no-cache",     no_argument,       0, OPT_NO_CACHE },
+		{ "disk-order",   optional_argument, 0, OPT_DISK_ORDER },
+		{ "max-memory",   required_argument, 0, OPT_MAX_MEMORY },
+		{ "hugepages",    no_argument,       0, OPT_HUGEPAGES },
+		{ "pool-stats",   no_argument,       0, OPT_POOL_STATS },
+		{ "stats",        optional_argument, 0, OPT_STATS },
+		{ "stats-interval", required_argument, 0, OPT_STATS_INTERVAL },
 		{ 0, 0, 0, 0 }
 	};
 
 	int opt;
-	while ((opt = getopt_long(argc, argv, "h:f:b:", long_opts, NULL)) != -1) {
+	while ((opt = getopt_long(argc, argv, "c:w:f:s:b:r:", long_opts, NULL)) != -1) {
 		switch (opt) {
+			case 'c':
+				manifest_path = optarg;
+				break;
+			case OPT_FAIL_FAST:
+				fail_fast = 1;
+				break;
 			case 'w':
-				hash_threadnum = atoi(optarg);
+				options.hash_threads = atoi(optarg);
 				break;
 			case 'f':
-				file_threadnum = atoi(optarg);
+				options.file_threads = atoi(optarg);
+				break;
+			case 's':
+				options.scan_threads = atoi(optarg);
 				break;
 			case 'b':
-				bigfile_limit = atoi(optarg);
-				int m = strlen(optarg);
-				if (optarg[m] == 'M')
-					bigfile_limit *= 1024 * 1024;
-				else if (optarg[m] == 'k')
-					bigfile_limit *= 1024;
+				options.bigfile_limit = parse_size(optarg);
+				break;
+			case 'r':
+				options.readers_per_file = atoi(optarg);
+				break;
+			case OPT_BLOCK_SIZE:
+				options.block_size = parse_size(optarg);
+				break;
+			case OPT_FANOUT:
+				options.fanout = atoi(optarg);
+				break;
+			case OPT_DEVICE_POLICY:
+				if (!strcmp(optarg, "hdd")) {
+					options.device_policy = FASTSUM_DEVICE_HDD;
+				} else if (!strcmp(optarg, "ssd")) {
+					options.device_policy = FASTSUM_DEVICE_SSD;
+				} else if (strcmp(optarg, "auto")) {
+					print_usage();
+					exit(1);
+				}
+				break;
+			case OPT_KERNEL:
+				kernel = optarg;
+				break;
+			case OPT_IO:
+				if (!strcmp(optarg, "uring")) {
+					options.use_uring = 1;
+				} else if (strcmp(optarg, "threads")) {
+					print_usage();
+					exit(1);
+				}
+				break;
+			case OPT_IO_DEPTH:
+				options.io_depth = atoi(optarg);
+				break;
+			case OPT_CACHE:
+				options.cache_path = optarg;
+				break;
+			case OPT_DIGESTS:
+				options.digests_path = optarg;
+				break;
+			case OPT_DIGESTS_EXTENTS:
+				options.digests_extents = 1;
+				break;
+			case OPT_AFFINITY:
+				options.affinity = 1;
+				break;
+			case OPT_READ_SIZE:
+				options.read_size = parse_size(optarg);
+				break;
+			case OPT_READAHEAD:
+				options.readahead = parse_size(optarg);
+				break;
+			case OPT_NO_CACHE:
+				options.no_cache = 1;
+				break;
+			case OPT_DISK_ORDER:
+				options.disk_order = optarg ? (size_t)atoi(optarg) : DISK_ORDER;
+				break;
+			case OPT_MAX_MEMORY:
+				options.max_memory = parse_size(optarg);
+				break;
+			case OPT_HUGEPAGES:
+				options.hugepages = 1;
+				break;
+			case OPT_POOL_STATS:
+				pool_stats = 1;
+				break;
+			case OPT_STATS:
+				if (optarg == NULL || !strcmp(optarg, "text")) {
+					stats_format = STATS_TEXT;
+				} else if (!strcmp(optarg, "json")) {
+					stats_format = STATS_JSON;
+				} else {
+					print_usage();
+					exit(1);
+				}
+				break;
+			case OPT_STATS_INTERVAL:
+				stats_interval = atof(optarg);
+				if (!stats_format) stats_format = STATS_TEXT;
 				break;
 			default:
 				print_usage();
@@ -429,84 +453,58 @@ int main (int argc, char **argv)
 		}
 	}
 
-	if (optind >= argc) {
+	if (manifest_path ? optind < argc : optind >= argc) {
 		print_usage();
 		exit(1);
 	}
 
-	/* initialize queues */
-	queue_init(&file_queue, QUEUE_SIZE);
-	queue_init(&hash_queue, QUEUE_SIZE);
-	queue_init_dynamic(&completed_queue, QUEUE_SIZE);
-
-	/* initialize workers */
-	pthread_t * file_threads = xmalloc(sizeof(pthread_t) * file_threadnum);
-	for (int i = 0; i < file_threadnum; ++i) {
-		pthread_create(&file_threads[i], NULL, file_worker, NULL);
-		pthread_setname_np(file_threads[i], "fastsum-filew");
+	if (sha256_select_kernel(kernel) == -1) {
+		fprintf(stderr, "SHA256 kernel '%s' is unknown or not supported by this CPU\n", kernel);
+		exit(1);
 	}
 
-	pthread_t * hash_threads = xmalloc(sizeof(pthread_t) * hash_threadnum);
-	for (int i = 0; i < hash_threadnum; ++i) {
-		pthread_create(&hash_threads[i], NULL, hash_worker, NULL);
-		pthread_setname_np(hash_threads[i], "fastsum-hashw");
-	}
+	/* before the context, so that it can register its queues and threads */
+	stats_start(stats_format, stats_interval, stderr);
 
-	pthread_t completion_thread;
-	pthread_create(&completion_thread, NULL, completion_worker, NULL);
-	pthread_setname_np(completion_thread, "fastsum-complw");
-
-	for (int i = optind; i < argc; ++i) {
-		struct stat st;
-
-		file_t * file = xmalloc(sizeof(file_t));
-		file->type = FILE_TASK;
-		file->path = strdup(argv[i]);
-
-		/* strip trailing slash(es) */
-		int len = strlen(file->path);
-		while (file->path[len] == '/') file->path[len--] = 0;
-
-		/* we need to post error messages to completion thread o_O */
-		int res = stat(argv[i], &st);
-		if (res == -1) {
-			file->error = strerror(errno);
-		} else if ((st.st_mode & S_IFMT) == S_IFDIR) {
-			directories_enqueued += 1;
-			do_process_directory(file->path);
-			free(file->path);
-			free(file);
-			continue;
+	if (manifest_path) {
+		manifest_status = do_process_manifest(manifest_path);
+	} else {
+		fastsum_t * ctx = context_for(options.block_size, options.fanout);
+		if (ctx == NULL && errno == EINVAL) {
+			fprintf(stderr, "block size must be a multiple of 1k up to 64M, fanout 0 or at least 2\n");
+			exit(1);
+		} else if (ctx == NULL) {
+			fprintf(stderr, "out of memory!\n");
+			exit(13);
 		}
 
-		file->state = STARTED;
-		queue_push(&file_queue, file);
-		files_posted += 1;
-	}
-
-	/* busy-wait for files finished because why not */
-	struct timespec sleep100ms = { .tv_sec = 0, .tv_nsec = 100 * 1000 * 1000 };
-	while (files_posted > files_done || directories_enqueued > 0) {
-		nanosleep(&sleep100ms, NULL);
+		for (int i = optind; i < argc; ++i) {
+			/* '-' is stdin, which may well be a pipe */
+			int res = strcmp(argv[i], "-") ? fastsum_submit_path(ctx, argv[i], NULL)
+			                                : fastsum_submit_fd(ctx, 0, "-", NULL);
+			if (res == -1) {
+				fprintf(stderr, "out of memory!\n");
+				exit(13);
+			}
+		}
 	}
 
-	/* stop queues */
-	queue_stop(&file_queue);
-	queue_stop(&hash_queue);
-	queue_stop(&completed_queue);
+	for (int i = 0; i < nshapes; ++i)
+		fastsum_wait(shapes[i].ctx);
 
-	for (int i = 0; i < file_threadnum; ++i)
-		pthread_join(file_threads[i], NULL);
-	for (int i = 0; i < hash_threadnum; ++i)
-		pthread_join(hash_threads[i], NULL);
-	pthread_join(completion_thread, NULL);
+	/* while the threads are still there to be asked about their CPU time */
+	stats_finish();
 
-	free(file_threads);
-	free(hash_threads);
+	for (int i = 0; i < nshapes; ++i) {
+		if (pool_stats) fastsum_print_stats(shapes[i].ctx, stderr);
+		fastsum_destroy(shapes[i].ctx);
+	}
 
-	queue_free(&file_queue);
-	queue_free(&hash_queue);
-	queue_free(&completed_queue);
+	if (manifest_path) {
+		fprintf(stderr, "%d OK, %d FAILED, %d MISSING\n", verify_ok, verify_failed, verify_missing);
+		if (manifest_status == -1) return 2;
+		if (verify_failed || verify_missing || manifest_status) return 1;
+	}
 
 	return 0;
 }
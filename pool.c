@@ -0,0 +1,271 @@
+#include <stdatomic.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+
+#include <sys/mman.h>
+
+#include "pool.h"
+
+/* objects moved between a thread cache and the shared list at once */
+#define POOL_BATCH 32
+/* distinct pools that can have a thread cache at the same time; past
+ * that, the cache of another pool is given back to make room */
+#define POOL_MAX 16
+
+#define CACHE_LINE 64
+#define HUGEPAGE_SIZE (2 * 1024 * 1024)
+
+typedef struct pool_cache {
+	unsigned id;		/* pool this cache belongs to, 0 = none */
+	pool_t * pool;
+	void * head;
+	size_t count;
+} pool_cache_t;
+
+static _Thread_local pool_cache_t caches[POOL_MAX];
+static _Thread_local unsigned next_victim;
+static _Atomic unsigned next_id = ATOMIC_VAR_INIT(1);
+
+/* pools not destroyed yet, so that an evicted cache is only given back
+ * to a pool that still owns its memory */
+static pthread_mutex_t live_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pool_t * live_pools;
+
+static inline void * next_of (void * object)
+{
+	void * next;
+	memcpy(&next, object, sizeof(next));
+	return next;
+}
+
+static inline void set_next (void * object, void * next)
+{
+	memcpy(object, &next, sizeof(next));
+}
+
+/* give a cache's objects back to its pool. if the pool was destroyed,
+ * they went with its memory */
+static void cache_flush (pool_cache_t * cache)
+{
+	pthread_mutex_lock(&live_mutex);
+	pool_t * pool = live_pools;
+	while (pool && pool != cache->pool) pool = pool->live_next;
+	if (pool && pool->id == cache->id) {
+		pthread_mutex_lock(&pool->mutex);
+		while (cache->head) {
+			void * object = cache->head;
+			cache->head = next_of(object);
+			set_next(object, pool->free_list);
+			pool->free_list = object;
+			pool->free_count += 1;
+		}
+		pthread_mutex_unlock(&pool->mutex);
+	}
+	pthread_mutex_unlock(&live_mutex);
+	cache->head = NULL;
+	cache->count = 0;
+}
+
+static pool_cache_t * cache_of (pool_t * pool)
+{
+	pool_cache_t * cache = NULL;
+	for (unsigned i = 0; i < POOL_MAX; ++i) {
+		if (caches[i].id == pool->id) return &caches[i];
+		/* an empty slot needs no flushing */
+		if (!cache && !caches[i].count) cache = &caches[i];
+	}
+	if (cache == NULL) {
+		cache = &caches[next_victim++ % POOL_MAX];
+		cache_flush(cache);
+	}
+	cache->id = pool->id;
+	cache->pool = pool;
+	cache->head = NULL;
+	cache->count = 0;
+	return cache;
+}
+
+/* carve a new chunk into the shared free list. called with mutex held */
+static int pool_grow (pool_t * pool)
+{
+	size_t size = pool->chunk_size;
+	char * chunk = MAP_FAILED;
+
+#ifdef MAP_HUGETLB
+	if (pool->flags & POOL_HUGEPAGES && size % HUGEPAGE_SIZE == 0)
+		chunk = mmap(NULL, size, PROT_READ | PROT_WRITE,
+		             MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+#endif
+	if (chunk == MAP_FAILED) {
+		/* no reserved huge pages, ask for transparent ones instead */
+		chunk = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+		if (chunk == MAP_FAILED) return -1;
+#ifdef MADV_HUGEPAGE
+		if (pool->flags & POOL_HUGEPAGES) madvise(chunk, size, MADV_HUGEPAGE);
+#endif
+	}
+
+	void ** chunks = realloc(pool->chunks, (pool->chunk_count + 1) * sizeof(void *));
+	if (chunks == NULL) {
+		munmap(chunk, size);
+		return -1;
+	}
+	pool->chunks = chunks;
+	pool->chunks[pool->chunk_count++] = chunk;
+
+	for (size_t off = 0; off + pool->object_size <= size; off += pool->object_size) {
+		set_next(chunk + off, pool->free_list);
+		pool->free_list = chunk + off;
+		pool->free_count += 1;
+		pool->objects += 1;
+	}
+	return 0;
+}
+
+void pool_init (pool_t * pool, char const * name, size_t object_size, size_t chunk_size,
+                size_t prealloc, int flags)
+{
+	size_t page = sysconf(_SC_PAGESIZE);
+
+	memset(pool, 0, sizeof(pool_t));
+	pool->name = name;
+	pool->id = next_id++;
+	pool->flags = flags;
+
+	if (object_size < sizeof(void*)) object_size = sizeof(void*);
+	pool->object_size = (object_size + CACHE_LINE - 1) & ~(size_t)(CACHE_LINE - 1);
+	/* page-sized objects stay page-aligned */
+	if (pool->object_size >= page)
+		pool->object_size = (pool->object_size + page - 1) & ~(page - 1);
+
+	if (chunk_size < pool->object_size) chunk_size = pool->object_size;
+	pool->chunk_size = (chunk_size + page - 1) & ~(page - 1);
+
+	pthread_mutex_init(&pool->mutex, NULL);
+
+	pthread_mutex_lock(&pool->mutex);
+	while (pool->objects < prealloc)
+		if (pool_grow(pool) == -1) break;
+	pthread_mutex_unlock(&pool->mutex);
+
+	pthread_mutex_lock(&live_mutex);
+	pool->live_next = live_pools;
+	live_pools = pool;
+	pthread_mutex_unlock(&live_mutex);
+}
+
+void * pool_alloc (pool_t * pool)
+{
+	if (pool->flags & POOL_UNCACHED) {
+		pthread_mutex_lock(&pool->mutex);
+		if (!pool->free_list) pool_grow(pool);
+		void * object = pool->free_list;
+		if (object) {
+			pool->free_list = next_of(object);
+			pool->free_count -= 1;
+		}
+		size_t out = pool->objects - pool->free_count;
+		if (out > pool->high_water) pool->high_water = out;
+		pthread_mutex_unlock(&pool->mutex);
+		return object;
+	}
+
+	pool_cache_t * cache = cache_of(pool);
+
+	if (!cache->count) {
+		/* refill a batch from the shared list */
+		pthread_mutex_lock(&pool->mutex);
+		if (pool->free_count < POOL_BATCH && !(pool->flags & POOL_FIXED)) pool_grow(pool);
+		while (cache->count < POOL_BATCH && pool->free_list) {
+			void * object = pool->free_list;
+			pool->free_list = next_of(object);
+			pool->free_count -= 1;
+			set_next(object, cache->head);
+			cache->head = object;
+			cache->count += 1;
+		}
+		size_t out = pool->objects - pool->free_count;
+		if (out > pool->high_water) pool->high_water = out;
+		pthread_mutex_unlock(&pool->mutex);
+
+		if (!cache->count) return NULL;
+	}
+
+	void * object = cache->head;
+	cache->head = next_of(object);
+	cache->count -= 1;
+	return object;
+}
+
+void pool_free (pool_t * pool, void * object)
+{
+	if (object == NULL) return;
+
+	if (pool->flags & (POOL_FIXED | POOL_UNCACHED)) {
+		/* there are only so many; don't let them sit in the cache
+		 * of a thread that never allocates */
+		pthread_mutex_lock(&pool->mutex);
+		set_next(object, pool->free_list);
+		pool->free_list = object;
+		pool->free_count += 1;
+		pthread_mutex_unlock(&pool->mutex);
+		return;
+	}
+
+	pool_cache_t * cache = cache_of(pool);
+	set_next(object, cache->head);
+	cache->head = object;
+	cache->count += 1;
+
+	if (cache->count >= 2 * POOL_BATCH) {
+		/* give a batch back, objects freed by a consumer thread
+		 * find their way back to the producer this way */
+		pthread_mutex_lock(&pool->mutex);
+		while (cache->count > POOL_BATCH) {
+			object = cache->head;
+			cache->head = next_of(object);
+			cache->count -= 1;
+			set_next(object, pool->free_list);
+			pool->free_list = object;
+			pool->free_count += 1;
+		}
+		pthread_mutex_unlock(&pool->mutex);
+	}
+}
+
+void pool_destroy (pool_t * pool)
+{
+	pthread_mutex_lock(&live_mutex);
+	pool_t ** link = &live_pools;
+	while (*link && *link != pool) link = &(*link)->live_next;
+	if (*link) *link = pool->live_next;
+	pthread_mutex_unlock(&live_mutex);
+
+	/* forget this thread's cache, other threads' caches are invalidated by id */
+	for (unsigned i = 0; i < POOL_MAX; ++i)
+		if (caches[i].id == pool->id) {
+			caches[i].id = 0;
+			caches[i].head = NULL;
+			caches[i].count = 0;
+		}
+
+	for (size_t i = 0; i < pool->chunk_count; ++i)
+		munmap(pool->chunks[i], pool->chunk_size);
+	free(pool->chunks);
+	pthread_mutex_destroy(&pool->mutex);
+}
+
+void pool_print_stats (pool_t * pool, FILE * out)
+{
+	pthread_mutex_lock(&pool->mutex);
+	fprintf(out, "pool %s: %zu-byte objects, %zu chunks (%zu kB), %zu objects, "
+	             "high water mark %zu objects (%zu kB)\n",
+	        pool->name, pool->object_size, pool->chunk_count,
+	        pool->chunk_count * pool->chunk_size / 1024, pool->objects,
+	        pool->high_water, pool->high_water * pool->object_size / 1024);
+	pthread_mutex_unlock(&pool->mutex);
+}
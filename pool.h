@@ -0,0 +1,49 @@
+#ifndef __POOL_H__
+#define __POOL_H__
+
+#include <stddef.h>
+#include <stdio.h>
+#include <pthread.h>
+
+/* Fixed-size object pool. Memory is taken from the system in large
+ * page-aligned chunks and never returned until pool_destroy. Each thread
+ * keeps a small cache of free objects; the shared free list is only
+ * touched when a cache runs empty or overflows, one batch at a time. */
+
+/* pool flags */
+#define POOL_HUGEPAGES 1	/* try to back chunks by huge pages */
+#define POOL_FIXED 2		/* never grow past what pool_init preallocated */
+#define POOL_UNCACHED 4		/* no thread caches, for objects so big that a
+				 * batch of them in every thread would be a lot */
+
+typedef struct pool {
+	char const * name;
+	unsigned id;
+	size_t object_size;
+	size_t chunk_size;
+	int flags;
+
+	pthread_mutex_t mutex;
+	void * free_list;	/* linked through the first word of each object */
+	size_t free_count;
+	void ** chunks;
+
+	/* statistics, guarded by mutex */
+	size_t chunk_count;
+	size_t objects;		/* carved out of chunks in total */
+	size_t high_water;	/* most objects outside the shared free list at once */
+
+	struct pool * live_next;	/* guarded by pool.c's list of live pools */
+} pool_t;
+
+/* `object_size` is rounded up to a cache line. `prealloc` objects are
+ * carved out right away. */
+void pool_init (pool_t * pool, char const * name, size_t object_size, size_t chunk_size,
+                size_t prealloc, int flags);
+/* returns NULL if out of memory; memory is not zeroed */
+void * pool_alloc (pool_t * pool);
+void pool_free (pool_t * pool, void * object);
+void pool_destroy (pool_t * pool);
+void pool_print_stats (pool_t * pool, FILE * out);
+
+#endif
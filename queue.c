@@ -1,129 +1,286 @@
 #include <assert.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <time.h>
 #include <pthread.h>
-#include <semaphore.h>
+#include <stdatomic.h>
 
 #include "queue.h"
 #include "tools.h"
 
-void queue_init (queue_t *queue, size_t capacity)
-{
-	queue->items = malloc(capacity * sizeof(void*));
-	queue->initial_capacity = queue->capacity = capacity;
-	queue->size = 0;
-
-	queue->head = queue->tail = 0;
-	queue->closed = 0;
+/* Bounded MPMC ring after Dmitry Vyukov: every cell carries a sequence
+ * number. A cell at position pos is free for the producer when seq == pos
+ * and holds an item for the consumer when seq == pos + 1. The consumer
+ * then sets seq to pos + capacity, i.e. free for the next lap.
+ * Batch operations claim a whole run of ready cells with a single CAS. */
 
-	queue->dynamic = 0;
+/* tries before a thread goes to sleep on an empty/full queue */
+#define SPIN_COUNT 100
 
-	pthread_mutex_init(&queue->mutex, NULL);
-	sem_init(&queue->consumable, 0, 0);
-	sem_init(&queue->produceable, 0, capacity);
+static inline void cpu_relax (void)
+{
+#if defined(__x86_64__) || defined(__i386__)
+	__builtin_ia32_pause();
+#elif defined(__aarch64__)
+	__asm__ __volatile__ ("yield");
+#endif
 }
 
-void queue_init_dynamic (queue_t *queue, size_t initial_capacity)
+static inline queue_cell_t * cell_at (queue_t *queue, size_t pos)
 {
-	queue_init(queue, initial_capacity);
-	queue->dynamic = 1;
+	return &queue->cells[pos & queue->mask];
 }
 
-void queue_push (queue_t *queue, void *item)
+/* claim and fill up to `count` cells, returns number pushed (0 if full) */
+static size_t ring_push (queue_t *queue, void **items, size_t count)
 {
-	if (!queue->dynamic) {
-		/* ensure this space for product */
-		sem_wait(&queue->produceable);
-		/* return space if queue closed */
-		if (queue->closed) {
-			sem_post(&queue->produceable);
-			return;
+	size_t pos = atomic_load_explicit(&queue->head, memory_order_relaxed);
+	size_t n;
+
+	for (;;) {
+		size_t seq = atomic_load_explicit(&cell_at(queue, pos)->seq, memory_order_acquire);
+		intptr_t diff = (intptr_t)(seq - pos);
+
+		if (diff < 0) return 0;	/* full */
+		if (diff > 0) {
+			/* somebody else got here first */
+			pos = atomic_load_explicit(&queue->head, memory_order_relaxed);
+			continue;
 		}
-	} else if (queue->closed) {
-		return;
+
+		for (n = 1; n < count; ++n) {
+			seq = atomic_load_explicit(&cell_at(queue, pos + n)->seq, memory_order_acquire);
+			if (seq != pos + n) break;
+		}
+
+		if (atomic_compare_exchange_weak_explicit(&queue->head, &pos, pos + n,
+				memory_order_relaxed, memory_order_relaxed))
+			break;
 	}
 
-	/* lock modify mutex */
-	pthread_mutex_lock(&queue->mutex);
+	for (size_t i = 0; i < n; ++i) {
+		queue_cell_t * cell = cell_at(queue, pos + i);
+		cell->item = items[i];
+		atomic_store_explicit(&cell->seq, pos + i + 1, memory_order_release);
+	}
+	return n;
+}
+
+/* claim and empty up to `max` cells, returns number popped (0 if empty) */
+static size_t ring_pop (queue_t *queue, void **items, size_t max)
+{
+	size_t pos = atomic_load_explicit(&queue->tail, memory_order_relaxed);
+	size_t n;
+
+	for (;;) {
+		size_t seq = atomic_load_explicit(&cell_at(queue, pos)->seq, memory_order_acquire);
+		intptr_t diff = (intptr_t)(seq - (pos + 1));
+
+		if (diff < 0) return 0;	/* empty */
+		if (diff > 0) {
+			pos = atomic_load_explicit(&queue->tail, memory_order_relaxed);
+			continue;
+		}
+
+		for (n = 1; n < max; ++n) {
+			seq = atomic_load_explicit(&cell_at(queue, pos + n)->seq, memory_order_acquire);
+			if (seq != pos + n + 1) break;
+		}
 
-	if (queue->dynamic && queue->size == queue->capacity) {
-		assert(queue->head == queue->tail);
-		/* allocate additional space */
-		int newcap = queue->capacity + queue->initial_capacity;
-		void ** newitems = xmalloc(newcap * sizeof(void*));
-		/* copy items so that queue starts at 0 */
-		memcpy(newitems, queue->items + queue->tail, (queue->capacity - queue->tail) * sizeof(void*));
-		memcpy(newitems + (queue->capacity - queue->tail), queue->items, queue->tail * sizeof(void*));
-
-		queue->tail = 0;
-		queue->head = queue->capacity;
-		queue->capacity = newcap;
-
-		free(queue->items);
-		queue->items = newitems;
+		if (atomic_compare_exchange_weak_explicit(&queue->tail, &pos, pos + n,
+				memory_order_relaxed, memory_order_relaxed))
+			break;
 	}
 
-	/* perform insertion */
-	queue->items[queue->head] = item;
-	queue->head = (queue->head + 1) % queue->capacity;
+	for (size_t i = 0; i < n; ++i) {
+		queue_cell_t * cell = cell_at(queue, pos + i);
+		items[i] = cell->item;
+		atomic_store_explicit(&cell->seq, pos + i + queue->capacity, memory_order_release);
+	}
+	return n;
+}
 
-	queue->size += 1;
+static int has_items (queue_t *queue)
+{
+	size_t pos = atomic_load_explicit(&queue->tail, memory_order_relaxed);
+	size_t seq = atomic_load_explicit(&cell_at(queue, pos)->seq, memory_order_acquire);
+	return seq == pos + 1;
+}
 
-	/* enable consumer to enter pop-mode */
-	sem_post(&queue->consumable);
-	/* unlock modify mutex */
-	pthread_mutex_unlock(&queue->mutex);
+static int has_space (queue_t *queue)
+{
+	size_t pos = atomic_load_explicit(&queue->head, memory_order_relaxed);
+	size_t seq = atomic_load_explicit(&cell_at(queue, pos)->seq, memory_order_acquire);
+	return seq == pos;
 }
 
-void * queue_pop (queue_t *queue)
+static uint64_t now_ns (void)
 {
-	/* ensure there is product to consume */
-	sem_wait(&queue->consumable);
-	/* closed queue, quit */
-	if (queue->closed) {
-		sem_post(&queue->consumable);
-		return NULL;
-	}
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+/* sleep until `ready` may be true; waiters register themselves first so
+ * that the other side knows it has to wake them up */
+static void queue_wait (queue_t *queue, _Atomic int *waiting, pthread_cond_t *cond,
+                        int (*ready) (queue_t *), _Atomic uint64_t *waits, _Atomic uint64_t *wait_ns)
+{
+	uint64_t start = queue->timed ? now_ns() : 0;
 
-	/* lock modify mutex */
 	pthread_mutex_lock(&queue->mutex);
+	atomic_fetch_add(waiting, 1);
+	atomic_thread_fence(memory_order_seq_cst);
+	while (!queue->closed && !ready(queue))
+		pthread_cond_wait(cond, &queue->mutex);
+	atomic_fetch_sub(waiting, 1);
+	pthread_mutex_unlock(&queue->mutex);
 
-	/* perform removal */
-	void * item = queue->items[queue->tail];
-	queue->tail = (queue->tail + 1) % queue->capacity;
+	if (!queue->timed) return;
+	atomic_fetch_add_explicit(waits, 1, memory_order_relaxed);
+	atomic_fetch_add_explicit(wait_ns, now_ns() - start, memory_order_relaxed);
+}
 
-	queue->size -= 1;
+static void queue_wake (queue_t *queue, _Atomic int *waiting, pthread_cond_t *cond, size_t count)
+{
+	atomic_thread_fence(memory_order_seq_cst);
+	if (!atomic_load_explicit(waiting, memory_order_relaxed)) return;
 
-	/* free up space for product */
-	if (!queue->dynamic)
-		sem_post(&queue->produceable);
-	/* unlock modify mutex */
+	pthread_mutex_lock(&queue->mutex);
+	if (count > 1)
+		pthread_cond_broadcast(cond);
+	else
+		pthread_cond_signal(cond);
 	pthread_mutex_unlock(&queue->mutex);
+}
+
+int queue_init (queue_t *queue, size_t capacity)
+{
+	/* round up to a power of two */
+	size_t size = 2;
+	while (size < capacity) size <<= 1;
 
+	queue->cells = xmalloc(size * sizeof(queue_cell_t));
+	if (queue->cells == NULL) return -1;
+	queue->capacity = size;
+	queue->mask = size - 1;
+	for (size_t i = 0; i < size; ++i)
+		atomic_init(&queue->cells[i].seq, i);
+
+	atomic_init(&queue->head, 0);
+	atomic_init(&queue->tail, 0);
+	queue->closed = 0;
+
+	atomic_init(&queue->waiting_consumers, 0);
+	atomic_init(&queue->waiting_producers, 0);
+	pthread_mutex_init(&queue->mutex, NULL);
+	pthread_cond_init(&queue->consumable, NULL);
+	pthread_cond_init(&queue->produceable, NULL);
+
+	queue->timed = 0;
+	atomic_init(&queue->push_waits, 0);
+	atomic_init(&queue->push_wait_ns, 0);
+	atomic_init(&queue->pop_waits, 0);
+	atomic_init(&queue->pop_wait_ns, 0);
+	return 0;
+}
+
+void queue_push (queue_t *queue, void *item)
+{
+	queue_push_many(queue, &item, 1);
+}
+
+void * queue_pop (queue_t *queue)
+{
+	void * item;
+	if (!queue_pop_many(queue, &item, 1)) return NULL;
 	return item;
 }
 
+void queue_push_many (queue_t *queue, void **items, size_t count)
+{
+	int spins = 0;
+
+	while (count) {
+		if (queue->closed) return;
+
+		size_t n = ring_push(queue, items, count);
+
+		if (n) {
+			queue_wake(queue, &queue->waiting_consumers, &queue->consumable, n);
+			items += n;
+			count -= n;
+			spins = 0;
+		} else if (++spins < SPIN_COUNT) {
+			cpu_relax();
+		} else {
+			queue_wait(queue, &queue->waiting_producers, &queue->produceable, has_space,
+			           &queue->push_waits, &queue->push_wait_ns);
+			spins = 0;
+		}
+	}
+}
+
+size_t queue_trypop_many (queue_t *queue, void **items, size_t max)
+{
+	/* closed queue, quit */
+	if (queue->closed) return 0;
+
+	size_t n = ring_pop(queue, items, max);
+
+	/* free up space for product */
+	if (n)
+		queue_wake(queue, &queue->waiting_producers, &queue->produceable, n);
+	return n;
+}
+
+size_t queue_pop_many (queue_t *queue, void **items, size_t max)
+{
+	int spins = 0;
+
+	for (;;) {
+		if (queue->closed) return 0;
+
+		size_t n = queue_trypop_many(queue, items, max);
+		if (n) return n;
+
+		if (++spins < SPIN_COUNT) {
+			cpu_relax();
+		} else {
+			queue_wait(queue, &queue->waiting_consumers, &queue->consumable, has_items,
+			           &queue->pop_waits, &queue->pop_wait_ns);
+			spins = 0;
+		}
+	}
+}
+
+size_t queue_depth (queue_t *queue)
+{
+	size_t tail = atomic_load_explicit(&queue->tail, memory_order_relaxed);
+	size_t head = atomic_load_explicit(&queue->head, memory_order_relaxed);
+	return head > tail ? head - tail : 0;
+}
 
 void queue_stop (queue_t *queue)
 {
 	/* first set closed flag */
 	queue->closed = 1;
-	/* then post both semaphores */
-	sem_post(&queue->consumable);
-	sem_post(&queue->produceable);
-	/* If a thread is in the middle of something while the queue is closed,
-	 * it must have cleared the semaphores, so there is valid something
-	 * for it to do. It's a responsibility of the caller to join() all threads
+	/* then wake up everybody who's sleeping */
+	pthread_mutex_lock(&queue->mutex);
+	pthread_cond_broadcast(&queue->consumable);
+	pthread_cond_broadcast(&queue->produceable);
+	pthread_mutex_unlock(&queue->mutex);
+	/* It's a responsibility of the caller to join() all threads
 	 * before issuing queue_free, so that threads that managed to
 	 * slip by at time of closing are certain to have finished. */
 }
 
 void queue_free (queue_t *queue)
 {
-	sem_destroy(&queue->consumable);
-	sem_destroy(&queue->produceable);
+	pthread_cond_destroy(&queue->consumable);
+	pthread_cond_destroy(&queue->produceable);
 	pthread_mutex_destroy(&queue->mutex);
-
-	free(queue->items);
+	free(queue->cells);
 }
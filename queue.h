@@ -1,28 +1,56 @@
 #ifndef __QUEUE_H__
 #define __QUEUE_H__
 
+#include <stddef.h>
+#include <stdint.h>
 #include <pthread.h>
-#include <semaphore.h>
+
+/* one slot of the ring; seq tells whose turn it is to use the slot */
+typedef struct queue_cell {
+	_Atomic size_t seq;
+	void* item;
+} queue_cell_t;
 
 typedef struct queue {
-	void** items;
+	queue_cell_t* cells;
 	size_t capacity;
-	size_t initial_capacity;
-	size_t size;
-	size_t head, tail;
+	size_t mask;
+
+	/* producers and consumers each get their own cache line */
+	_Alignas(64) _Atomic size_t head;
+	_Alignas(64) _Atomic size_t tail;
 
-	int dynamic;
+	_Alignas(64) _Atomic int closed;
 
-	_Atomic int closed;
-	sem_t consumable;
-	sem_t produceable;
+	/* blocking fallback when the ring is empty/full */
+	_Atomic int waiting_consumers;
+	_Atomic int waiting_producers;
+	pthread_cond_t consumable;
+	pthread_cond_t produceable;
 	pthread_mutex_t mutex;
+
+	/* statistics: sleeps on a full/empty queue and the time spent in them,
+	 * only counted if `timed`, which stats_add_queue sets */
+	int timed;
+	_Atomic uint64_t push_waits;
+	_Atomic uint64_t push_wait_ns;
+	_Atomic uint64_t pop_waits;
+	_Atomic uint64_t pop_wait_ns;
 } queue_t;
 
-void queue_init (queue_t *queue, size_t capacity);
-void queue_init_dynamic (queue_t *queue, size_t initial_capacity);
+/* return -1 and errno if out of memory */
+int queue_init (queue_t *queue, size_t capacity);
 void queue_push (queue_t *queue, void *item);
 void* queue_pop (queue_t *queue);
+/* push all `count` items, blocking while the queue is full */
+void queue_push_many (queue_t *queue, void **items, size_t count);
+/* pop at least one and at most `max` items, blocking only for the first.
+ * returns number of items popped, 0 if the queue is closed */
+size_t queue_pop_many (queue_t *queue, void **items, size_t max);
+/* like queue_pop_many, but returns 0 instead of blocking on an empty queue */
+size_t queue_trypop_many (queue_t *queue, void **items, size_t max);
+/* number of items in the queue, approximately */
+size_t queue_depth (queue_t *queue);
 void queue_stop (queue_t *queue);
 void queue_free (queue_t *queue);
 
@@ -0,0 +1,378 @@
+#include <errno.h>
+#include <fcntl.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <dirent.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+
+#include <stdatomic.h>
+#include <pthread.h>
+
+#include "scan.h"
+#include "tools.h"
+
+/* getdents64 buffer per thread */
+#define SCAN_BUFSIZE (128 * 1024)
+/* directory fds kept open for openat() of their subdirectories.
+ * past this, subdirectories are opened by full path, so that we don't
+ * starve the file readers of descriptors */
+#define SCAN_MAX_OPEN_DIRS 256
+
+struct linux_dirent64 {
+	uint64_t d_ino;
+	int64_t d_off;
+	unsigned short d_reclen;
+	unsigned char d_type;
+	char d_name[];
+};
+
+/* open directory shared by its queued subdirectories */
+typedef struct scan_dir {
+	int fd;
+	_Atomic int refs;
+	size_t pathlen;
+} scan_dir_t;
+
+/* directory waiting to be read */
+typedef struct scan_item {
+	scan_dir_t * parent;	/* NULL: open by path */
+	char * path;
+	void * tag;		/* of the tree it belongs to */
+} scan_item_t;
+
+/* owner works at the bottom, thieves take from the top */
+typedef struct scan_deque {
+	pthread_mutex_t mutex;
+	scan_item_t * items;
+	size_t capacity;
+	size_t top, bottom;
+} scan_deque_t;
+
+typedef struct scan_thread {
+	scanner_t * scanner;
+	int index;
+	pthread_t thread;
+	char * buf;		/* for getdents64 */
+} scan_thread_t;
+
+struct scanner {
+	int nthreads;
+	scan_thread_t * threads;
+	scan_deque_t * deques;
+
+	scan_file_fn on_file;
+	scan_error_fn on_error;
+	void * arg;
+
+	_Atomic size_t queued;		/* directories in deques */
+	_Atomic size_t pending;		/* directories queued or being read */
+	_Atomic int open_dirs;
+	_Atomic unsigned next_root;
+
+	pthread_mutex_t idle_mutex;
+	pthread_cond_t idle_cond;	/* new work, or finished */
+	pthread_cond_t done_cond;	/* pending dropped to zero */
+	_Atomic int idle;
+	_Atomic int finishing;
+};
+
+
+/* returns -1 if out of memory */
+static int deque_push (scan_deque_t * deque, scan_item_t item)
+{
+	pthread_mutex_lock(&deque->mutex);
+	if (deque->bottom == deque->capacity) {
+		if (deque->top > 0) {
+			/* reclaim the space thieves left behind */
+			memmove(deque->items, deque->items + deque->top,
+			        (deque->bottom - deque->top) * sizeof(scan_item_t));
+			deque->bottom -= deque->top;
+			deque->top = 0;
+		} else {
+			size_t capacity = deque->capacity ? 2 * deque->capacity : 64;
+			scan_item_t * items = realloc(deque->items, capacity * sizeof(scan_item_t));
+			if (items == NULL) {
+				pthread_mutex_unlock(&deque->mutex);
+				return -1;
+			}
+			deque->items = items;
+			deque->capacity = capacity;
+		}
+	}
+	deque->items[deque->bottom++] = item;
+	pthread_mutex_unlock(&deque->mutex);
+	return 0;
+}
+
+static int deque_pop (scan_deque_t * deque, scan_item_t * item, int steal)
+{
+	int found = 0;
+
+	pthread_mutex_lock(&deque->mutex);
+	if (deque->top < deque->bottom) {
+		*item = steal ? deque->items[deque->top++] : deque->items[--deque->bottom];
+		found = 1;
+	}
+	if (deque->top == deque->bottom) deque->top = deque->bottom = 0;
+	pthread_mutex_unlock(&deque->mutex);
+
+	return found;
+}
+
+static void dir_release (scanner_t * scanner, scan_dir_t * dir)
+{
+	if (--dir->refs) return;
+	close(dir->fd);
+	scanner->open_dirs -= 1;
+	free(dir);
+}
+
+/* a directory is read, or dropped; wake up whoever waits for the last */
+static void scan_release (scanner_t * scanner)
+{
+	if (--scanner->pending) return;
+	pthread_mutex_lock(&scanner->idle_mutex);
+	pthread_cond_broadcast(&scanner->done_cond);
+	pthread_cond_broadcast(&scanner->idle_cond);
+	pthread_mutex_unlock(&scanner->idle_mutex);
+}
+
+/* a directory that can't be queued is reported, and that's it */
+static void scan_push (scanner_t * scanner, int index, scan_item_t item)
+{
+	scanner->pending += 1;
+	if (deque_push(&scanner->deques[index], item) == -1) {
+		scanner->on_error(item.path, ENOMEM, item.tag, scanner->arg);
+		if (item.parent) dir_release(scanner, item.parent);
+		free(item.path);
+		scan_release(scanner);
+		return;
+	}
+	scanner->queued += 1;
+
+	/* wake up an idle thread to steal it */
+	if (scanner->idle) {
+		pthread_mutex_lock(&scanner->idle_mutex);
+		pthread_cond_signal(&scanner->idle_cond);
+		pthread_mutex_unlock(&scanner->idle_mutex);
+	}
+}
+
+static int scan_take (scanner_t * scanner, int index, scan_item_t * item)
+{
+	/* own deque first, then go around the others */
+	for (int i = 0; i < scanner->nthreads; ++i) {
+		int victim = (index + i) % scanner->nthreads;
+		if (deque_pop(&scanner->deques[victim], item, victim != index)) {
+			scanner->queued -= 1;
+			return 1;
+		}
+	}
+	return 0;
+}
+
+static void scan_directory (scanner_t * scanner, int index, scan_item_t * item, char * buf)
+{
+	char * path = item->path;
+	int flags = O_RDONLY | O_DIRECTORY | O_CLOEXEC;
+	int fd;
+
+	if (item->parent) {
+		fd = openat(item->parent->fd, path + item->parent->pathlen + 1, flags);
+		if (fd == -1 && (errno == EMFILE || errno == ENFILE))
+			fd = open(path, flags);
+		dir_release(scanner, item->parent);
+	} else {
+		fd = open(path, flags);
+	}
+	if (fd == -1) {
+		scanner->on_error(path, errno, item->tag, scanner->arg);
+		free(path);
+		return;
+	}
+
+	size_t pathlen = strlen(path);
+	scan_dir_t * dir = NULL;
+	if (scanner->open_dirs < SCAN_MAX_OPEN_DIRS) {
+		dir = malloc(sizeof(scan_dir_t));
+		if (dir != NULL) {
+			dir->fd = fd;
+			dir->refs = 1;
+			dir->pathlen = pathlen;
+			scanner->open_dirs += 1;
+		}
+	}
+
+	for (;;) {
+		long bytes = syscall(SYS_getdents64, fd, buf, SCAN_BUFSIZE);
+		if (bytes == -1) {
+			scanner->on_error(path, errno, item->tag, scanner->arg);
+			break;
+		}
+		if (bytes == 0) break;
+
+		for (long off = 0; off < bytes; ) {
+			struct linux_dirent64 * dirent = (struct linux_dirent64 *)(buf + off);
+			char const * name = dirent->d_name;
+			off += dirent->d_reclen;
+
+			if (name[0] == '.' &&
+			     (name[1] == 0 ||
+			       (name[1] == '.' && name[2] == 0)
+			     )
+			   ) continue;
+
+			size_t len = strlen(name);
+			char * newpath = malloc(pathlen + 1 + len + 1);
+			if (newpath == NULL) {
+				scanner->on_error(path, errno, item->tag, scanner->arg);
+				continue;
+			}
+			memcpy(newpath, path, pathlen);
+			newpath[pathlen] = '/';
+			memcpy(newpath + pathlen + 1, name, len + 1);
+
+			unsigned char type = dirent->d_type;
+			if (type == DT_UNKNOWN) {
+				/* filesystem doesn't tell, ask */
+				struct stat st;
+				if (fstatat(fd, name, &st, AT_SYMLINK_NOFOLLOW) == 0)
+					type = IFTODT(st.st_mode);
+			}
+
+			if (type == DT_DIR) {
+				scan_item_t sub = { .parent = dir, .path = newpath, .tag = item->tag };
+				if (dir) dir->refs += 1;
+				scan_push(scanner, index, sub);
+			} else {
+				scanner->on_file(newpath, type, item->tag, scanner->arg);
+			}
+		}
+	}
+
+	if (dir)
+		dir_release(scanner, dir);
+	else
+		close(fd);
+	free(path);
+}
+
+static void * scan_worker (void * arg)
+{
+	scan_thread_t * self = arg;
+	scanner_t * scanner = self->scanner;
+	scan_item_t item;
+
+	for (;;) {
+		if (scan_take(scanner, self->index, &item)) {
+			scan_directory(scanner, self->index, &item, self->buf);
+			scan_release(scanner);
+			continue;
+		}
+
+		/* nothing to do or steal; sleep until somebody pushes */
+		pthread_mutex_lock(&scanner->idle_mutex);
+		scanner->idle += 1;
+		while (!scanner->queued && !(scanner->finishing && !scanner->pending))
+			pthread_cond_wait(&scanner->idle_cond, &scanner->idle_mutex);
+		scanner->idle -= 1;
+		int quit = scanner->finishing && !scanner->pending;
+		pthread_mutex_unlock(&scanner->idle_mutex);
+
+		if (quit) break;
+	}
+
+	return NULL;
+}
+
+scanner_t * scan_create (int threads, scan_file_fn on_file, scan_error_fn on_error, void * arg)
+{
+	if (threads < 1) threads = 1;
+
+	scanner_t * scanner = xmalloc(sizeof(scanner_t));
+	if (scanner == NULL) return NULL;
+	scanner->deques = xmalloc(threads * sizeof(scan_deque_t));
+	scanner->threads = xmalloc(threads * sizeof(scan_thread_t));
+	int ok = scanner->deques && scanner->threads;
+	for (int i = 0; ok && i < threads; ++i)
+		ok = (scanner->threads[i].buf = malloc(SCAN_BUFSIZE)) != NULL;
+	if (!ok) {
+		for (int i = 0; scanner->threads && i < threads; ++i)
+			free(scanner->threads[i].buf);
+		free(scanner->threads);
+		free(scanner->deques);
+		free(scanner);
+		errno = ENOMEM;
+		return NULL;
+	}
+
+	scanner->nthreads = threads;
+	scanner->on_file = on_file;
+	scanner->on_error = on_error;
+	scanner->arg = arg;
+
+	pthread_mutex_init(&scanner->idle_mutex, NULL);
+	pthread_cond_init(&scanner->idle_cond, NULL);
+	pthread_cond_init(&scanner->done_cond, NULL);
+
+	for (int i = 0; i < threads; ++i)
+		pthread_mutex_init(&scanner->deques[i].mutex, NULL);
+
+	for (int i = 0; i < threads; ++i) {
+		scanner->threads[i].scanner = scanner;
+		scanner->threads[i].index = i;
+		pthread_create(&scanner->threads[i].thread, NULL, scan_worker, &scanner->threads[i]);
+		pthread_setname_np(scanner->threads[i].thread, "fastsum-scanw");
+	}
+
+	return scanner;
+}
+
+void scan_add_directory (scanner_t * scanner, char const * path, void * tag)
+{
+	scan_item_t item = { .parent = NULL, .path = strdup(path), .tag = tag };
+	if (item.path == NULL) {
+		scanner->on_error(path, errno, tag, scanner->arg);
+		return;
+	}
+	/* spread roots over the threads */
+	scan_push(scanner, scanner->next_root++ % scanner->nthreads, item);
+}
+
+void scan_wait (scanner_t * scanner)
+{
+	pthread_mutex_lock(&scanner->idle_mutex);
+	while (scanner->pending)
+		pthread_cond_wait(&scanner->done_cond, &scanner->idle_mutex);
+	pthread_mutex_unlock(&scanner->idle_mutex);
+}
+
+void scan_finish (scanner_t * scanner)
+{
+	pthread_mutex_lock(&scanner->idle_mutex);
+	while (scanner->pending)
+		pthread_cond_wait(&scanner->done_cond, &scanner->idle_mutex);
+	scanner->finishing = 1;
+	pthread_cond_broadcast(&scanner->idle_cond);
+	pthread_mutex_unlock(&scanner->idle_mutex);
+
+	for (int i = 0; i < scanner->nthreads; ++i)
+		pthread_join(scanner->threads[i].thread, NULL);
+
+	for (int i = 0; i < scanner->nthreads; ++i) {
+		pthread_mutex_destroy(&scanner->deques[i].mutex);
+		free(scanner->deques[i].items);
+		free(scanner->threads[i].buf);
+	}
+	pthread_mutex_destroy(&scanner->idle_mutex);
+	pthread_cond_destroy(&scanner->idle_cond);
+	pthread_cond_destroy(&scanner->done_cond);
+
+	free(scanner->deques);
+	free(scanner->threads);
+	free(scanner);
+}
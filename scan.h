@@ -0,0 +1,29 @@
+#ifndef __SCAN_H__
+#define __SCAN_H__
+
+/* Parallel directory traversal. A pool of scanner threads walks directory
+ * trees; each thread has its own deque of directories to read and steals
+ * from the others when it runs dry. Directories are opened with openat()
+ * relative to their parent and read with getdents64 into large buffers. */
+
+/* called for every entry that is not a directory. takes ownership of
+ * `path` (malloc'd). d_type is the DT_* value from the directory entry,
+ * `tag` the one its tree was added with */
+typedef void (*scan_file_fn) (char * path, unsigned char d_type, void * tag, void * arg);
+/* called when a directory can't be opened or read, or queued for lack
+ * of memory */
+typedef void (*scan_error_fn) (char const * path, int err, void * tag, void * arg);
+
+typedef struct scanner scanner_t;
+
+/* returns NULL and errno if out of memory */
+scanner_t * scan_create (int threads, scan_file_fn on_file, scan_error_fn on_error, void * arg);
+/* queue a directory tree; may be called while the scan is running,
+ * from any thread */
+void scan_add_directory (scanner_t * scanner, char const * path, void * tag);
+/* wait until all queued trees are scanned; the threads stay for more */
+void scan_wait (scanner_t * scanner);
+/* wait until all queued trees are scanned, then stop the threads and free everything */
+void scan_finish (scanner_t * scanner);
+
+#endif
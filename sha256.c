@@ -4,6 +4,7 @@
 #include <string.h>
 
 #include "sha256.h"
+#include "sha256_impl.h"
 
 /* pieces of code taken from sha256 implementation at https://github.com/B-Con/crypto-algorithms */
 
@@ -22,7 +23,7 @@
 #define SIG0(x) (ROTRIGHT(x,7) ^ ROTRIGHT(x,18) ^ ((x) >> 3))
 #define SIG1(x) (ROTRIGHT(x,17) ^ ROTRIGHT(x,19) ^ ((x) >> 10))
 
-static uint32_t const k[64] = {
+uint32_t const sha256_k[64] = {
 	0x428a2f98,0x71374491,0xb5c0fbcf,0xe9b5dba5,0x3956c25b,0x59f111f1,0x923f82a4,0xab1c5ed5,
 	0xd807aa98,0x12835b01,0x243185be,0x550c7dc3,0x72be5d74,0x80deb1fe,0x9bdc06a7,0xc19bf174,
 	0xe49b69c1,0xefbe4786,0x0fc19dc6,0x240ca1cc,0x2de92c6f,0x4a7484aa,0x5cb0a9dc,0x76f988da,
@@ -33,7 +34,7 @@ static uint32_t const k[64] = {
 	0x748f82ee,0x78a5636f,0x84c87814,0x8cc70208,0x90befffa,0xa4506ceb,0xbef9a3f7,0xc67178f2
 };
 
-static uint32_t const initial_state[8] = {
+uint32_t const sha256_initial_state[8] = {
 	0x6a09e667,
 	0xbb67ae85,
 	0x3c6ef372,
@@ -45,13 +46,20 @@ static uint32_t const initial_state[8] = {
 };
 
 
-static void sha256_transform (uint32_t state[], char const * buffer)
+static inline uint32_t load_be32 (char const * p)
+{
+	uint32_t v;
+	/* memcpy instead of a pointer cast, the buffer is plain char */
+	memcpy(&v, p, sizeof(v));
+	return __builtin_bswap32(v);
+}
+
+static void sha256_transform_one (uint32_t state[], char const * data)
 {
 	uint32_t a, b, c, d, e, f, g, h, t1, t2, tm, m[16];
-	uint32_t const * data = (uint32_t const *)buffer;
 
 /*	for (int i = 0; i < 16; ++i)
-		m[i] = __builtin_bswap32(data[i]);
+		m[i] = load_be32(data + 4 * i);
 
 	for (int i = 16; i < 64; ++i)
 		m[i] = SIG1(m[i - 2])  + m[i - 7]
@@ -73,17 +81,17 @@ static void sha256_transform (uint32_t state[], char const * buffer)
 } while(0);
 
 #define CIRCLE(st, M) do { \
-	ROUND(a, b, c, d, e, f, g, h, k[st], M(st)); \
-	ROUND(h, a, b, c, d, e, f, g, k[st + 1], M(st + 1)); \
-	ROUND(g, h, a, b, c, d, e, f, k[st + 2], M(st + 2)); \
-	ROUND(f, g, h, a, b, c, d, e, k[st + 3], M(st + 3)); \
-	ROUND(e, f, g, h, a, b, c, d, k[st + 4], M(st + 4)); \
-	ROUND(d, e, f, g, h, a, b, c, k[st + 5], M(st + 5)); \
-	ROUND(c, d, e, f, g, h, a, b, k[st + 6], M(st + 6)); \
-	ROUND(b, c, d, e, f, g, h, a, k[st + 7], M(st + 7)); \
+	ROUND(a, b, c, d, e, f, g, h, sha256_k[st], M(st)); \
+	ROUND(h, a, b, c, d, e, f, g, sha256_k[st + 1], M(st + 1)); \
+	ROUND(g, h, a, b, c, d, e, f, sha256_k[st + 2], M(st + 2)); \
+	ROUND(f, g, h, a, b, c, d, e, sha256_k[st + 3], M(st + 3)); \
+	ROUND(e, f, g, h, a, b, c, d, sha256_k[st + 4], M(st + 4)); \
+	ROUND(d, e, f, g, h, a, b, c, sha256_k[st + 5], M(st + 5)); \
+	ROUND(c, d, e, f, g, h, a, b, sha256_k[st + 6], M(st + 6)); \
+	ROUND(b, c, d, e, f, g, h, a, sha256_k[st + 7], M(st + 7)); \
 } while(0);
 
-#define M_PLAIN(i) (m[i] = __builtin_bswap32(data[i]))
+#define M_PLAIN(i) (m[i] = load_be32(data + 4 * (i)))
 
 #define M_FULL(i) ( \
 	tm = SIG1(m[((i)- 2) & 0x0f]) + m[((i)-7) & 0x0f] \
@@ -107,44 +115,177 @@ static void sha256_transform (uint32_t state[], char const * buffer)
 }
 
 
+void sha256_transform_scalar (uint32_t state[8], char const * data, size_t blocks)
+{
+	while (blocks--) {
+		sha256_transform_one(state, data);
+		data += 64;
+	}
+}
+
+
+/* kernel dispatch */
+
+static struct {
+	char const * name;
+	sha256_transform_fn transform;
+	sha256_mb_fn mb;
+	int lanes;
+	int (*supported) (void);
+} const kernels[] = {
+	/* in order of preference for "auto" */
+	{ "shani",  sha256_transform_shani,  NULL, 1, sha256_shani_supported },
+	{ "armv8",  sha256_transform_armv8,  NULL, 1, sha256_armv8_supported },
+	/* multi-buffer kernels, single messages still go through scalar */
+	{ "avx512", sha256_transform_scalar, sha256_mb_avx512, 16, sha256_avx512_supported },
+	{ "avx2",   sha256_transform_scalar, sha256_mb_avx2,    8, sha256_avx2_supported },
+	{ "scalar", sha256_transform_scalar, NULL, 1, NULL },
+};
+
+#define KERNEL_COUNT (sizeof(kernels) / sizeof(kernels[0]))
+
+static sha256_transform_fn sha256_transform = sha256_transform_scalar;
+static sha256_mb_fn sha256_mb = NULL;
+static int sha256_mb_lanes = 1;
+static char const * kernel_name = "scalar";
+
+int sha256_select_kernel (char const * name)
+{
+	int autoselect = !strcmp(name, "auto");
+
+	for (size_t i = 0; i < KERNEL_COUNT; ++i) {
+		if (!autoselect && strcmp(name, kernels[i].name)) continue;
+		if (kernels[i].supported && !kernels[i].supported()) {
+			if (autoselect) continue;
+			return -1;
+		}
+		sha256_transform = kernels[i].transform;
+		sha256_mb = kernels[i].mb;
+		sha256_mb_lanes = kernels[i].lanes;
+		kernel_name = kernels[i].name;
+		return 0;
+	}
+	return -1;
+}
+
+char const * sha256_kernel_name (void)
+{
+	return kernel_name;
+}
+
+
+size_t sha256_pad (char buffer[128], char const * tail, size_t remain, size_t length)
+{
+	size_t blocks = 1;
+
+	memcpy(buffer, tail, remain);
+	buffer[remain++] = (char)0x80;
+
+	if (remain > 56) {
+		/* if datalen > 55, no place for bitcount. needs another block */
+		blocks = 2;
+	}
+	/* clean up to the bitcount */
+	while (remain < 64 * blocks - 8) buffer[remain++] = 0;
+
+	/* Append to the padding the total message's length in bits */
+	uint64_t bitlen = __builtin_bswap64((uint64_t)length << 3);
+	memcpy(buffer + remain, &bitlen, sizeof(bitlen));
+
+	return blocks;
+}
+
 void sha256_hash_block (char const * block, size_t length, char * result)
 {
 	uint32_t state[8];
-	char buffer[64];
+	char buffer[128];
 
-	memcpy(state, initial_state, sizeof(state));
+	memcpy(state, sha256_initial_state, sizeof(state));
 
-	/* process 64bit chunks */
+	/* process whole 64-byte chunks */
 	size_t remain = length;
-	while (remain > 64) {
-		sha256_transform(state, block);
-		block += 64;
-		remain -= 64;
-	}
+	sha256_transform(state, block, remain / 64);
+	block += remain & ~(size_t)63;
+	remain &= 63;
 
 	/* finalize hash */
-	memcpy(buffer, block, remain);
-	buffer[remain++] = (char)0x80;
+	sha256_transform(state, buffer, sha256_pad(buffer, block, remain, length));
 
-	if (remain < 56) {
-		/* clean up to 56th byte */
-		while (remain < 56) buffer[remain++] = 0;
-	} else {
-		/* if datalen >= 56, no place for bitcount. do one transformation */
-		while (remain < 64) buffer[remain++] = 0;
-		sha256_transform(state, buffer);
-		memset(buffer, 0, 56);
+	for (int i = 0; i < 8; ++i) {
+		uint32_t word = __builtin_bswap32(state[i]);
+		memcpy(result + 4 * i, &word, sizeof(word));
 	}
+}
 
-	/* Append to the padding the total message's length in bits */
-	uint64_t bitlen = length << 3;
-	uint64_t * bitfld = (uint64_t *)(buffer + 56);
-	*bitfld = __builtin_bswap64(bitlen);
-	/* last transform round */
-	sha256_transform(state, buffer);
+void sha256_init (sha256_ctx_t * ctx)
+{
+	memcpy(ctx->state, sha256_initial_state, sizeof(ctx->state));
+	ctx->buffered = 0;
+	ctx->length = 0;
+}
+
+void sha256_update (sha256_ctx_t * ctx, char const * data, size_t length)
+{
+	ctx->length += length;
+
+	/* top up the partial block first */
+	if (ctx->buffered) {
+		size_t n = 64 - ctx->buffered < length ? 64 - ctx->buffered : length;
+		memcpy(ctx->buffer + ctx->buffered, data, n);
+		ctx->buffered += n;
+		data += n;
+		length -= n;
+		if (ctx->buffered < 64) return;
+		sha256_transform(ctx->state, ctx->buffer, 1);
+		ctx->buffered = 0;
+	}
+
+	/* whole blocks straight from the input */
+	sha256_transform(ctx->state, data, length / 64);
+	data += length & ~(size_t)63;
+	length &= 63;
+
+	memcpy(ctx->buffer, data, length);
+	ctx->buffered = length;
+}
+
+void sha256_final (sha256_ctx_t * ctx, char * result)
+{
+	char buffer[128];
+
+	sha256_transform(ctx->state, buffer, sha256_pad(buffer, ctx->buffer, ctx->buffered, ctx->length));
 
-	uint32_t * result_words = (uint32_t *)result;
 	for (int i = 0; i < 8; ++i) {
-		result_words[i] = __builtin_bswap32(state[i]);
+		uint32_t word = __builtin_bswap32(ctx->state[i]);
+		memcpy(result + 4 * i, &word, sizeof(word));
+	}
+}
+
+void sha256_hash_blocks (char const * const blocks[], size_t length, char * const results[], int count)
+{
+	int i = 0;
+
+	if (sha256_mb) {
+		char const * group_blocks[SHA256_MAX_LANES];
+		char * group_results[SHA256_MAX_LANES];
+		char dummy[HASH_SIZE];
+
+		for (; count - i >= 2; i += sha256_mb_lanes) {
+			/* a partial group is padded with repeats of its first message */
+			for (int l = 0; l < sha256_mb_lanes; ++l) {
+				int have = i + l < count;
+				group_blocks[l] = blocks[have ? i + l : i];
+				group_results[l] = have ? results[i + l] : dummy;
+			}
+			sha256_mb(group_blocks, length, group_results);
+		}
 	}
+
+	for (; i < count; ++i)
+		sha256_hash_block(blocks[i], length, results[i]);
+}
+
+int sha256_lanes (void)
+{
+	return sha256_mb ? sha256_mb_lanes : 1;
 }
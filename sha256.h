@@ -1,9 +1,41 @@
+
 #ifndef __SHA256_H__
 #define __SHA256_H__
+#include <stddef.h>
 #include <stdint.h>
 
 #define HASH_SIZE 32
 
 void sha256_hash_block (char const * block, size_t length, char * result);
 
+/* Hash `count` independent messages that all have the same length;
+ * results[i] receives the hash of blocks[i]. With a multi-buffer kernel
+ * selected, sha256_lanes() messages are hashed at once in SIMD lanes. */
+void sha256_hash_blocks (char const * const blocks[], size_t length, char * const results[], int count);
+/* number of messages the selected kernel hashes in parallel (1 if it can't) */
+int sha256_lanes (void);
+
+/* Incremental hashing, for a message that arrives in pieces; same
+ * result as sha256_hash_block over all the pieces put together. */
+typedef struct sha256_ctx {
+	uint32_t state[8];
+	char buffer[64];	/* partial 64-byte block */
+	size_t buffered;
+	uint64_t length;
+} sha256_ctx_t;
+
+void sha256_init (sha256_ctx_t * ctx);
+void sha256_update (sha256_ctx_t * ctx, char const * data, size_t length);
+void sha256_final (sha256_ctx_t * ctx, char * result);
+
+/* Select the compression kernel used by sha256_hash_block(s).
+ * `name` is one of "auto", "scalar", "shani", "armv8", "avx2" or
+ * "avx512"; "auto" picks the fastest kernel supported by the CPU
+ * (preferring SHA extensions over multi-buffer). Must be called before any
+ * hashing threads are started. Returns 0 on success, -1 if the kernel
+ * is unknown or not supported on this machine. */
+int sha256_select_kernel (char const * name);
+/* name of the currently selected kernel */
+char const * sha256_kernel_name (void);
+
 #endif
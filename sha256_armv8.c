@@ -0,0 +1,88 @@
+#include <stdint.h>
+
+#include "sha256_impl.h"
+
+/* SHA256 compression using the ARMv8 cryptography extensions (SHA2). */
+
+#if defined(__aarch64__)
+
+#include <arm_neon.h>
+#include <sys/auxv.h>
+
+#ifndef HWCAP_SHA2
+#define HWCAP_SHA2 (1 << 6)
+#endif
+
+int sha256_armv8_supported (void)
+{
+	return (getauxval(AT_HWCAP) & HWCAP_SHA2) != 0;
+}
+
+/* Four rounds starting at round 4*G using message words W0.
+ * If UPD is set, W0 is replaced by the message words for round 4*(G+4). */
+#define QROUND(G, W0, W1, W2, W3, UPD) do { \
+	tmp = vaddq_u32(W0, vld1q_u32(&sha256_k[4 * (G)])); \
+	if (UPD) W0 = vsha256su1q_u32(vsha256su0q_u32(W0, W1), W2, W3); \
+	abcd = state0; \
+	state0 = vsha256hq_u32(state0, state1, tmp); \
+	state1 = vsha256h2q_u32(state1, abcd, tmp); \
+} while (0)
+
+__attribute__((target("+crypto")))
+void sha256_transform_armv8 (uint32_t state[8], char const * data, size_t blocks)
+{
+	uint32x4_t state0, state1, abcd_save, efgh_save, abcd, tmp;
+	uint32x4_t w0, w1, w2, w3;
+
+	state0 = vld1q_u32(&state[0]);
+	state1 = vld1q_u32(&state[4]);
+
+	while (blocks--) {
+		abcd_save = state0;
+		efgh_save = state1;
+
+		w0 = vreinterpretq_u32_u8(vrev32q_u8(vld1q_u8((uint8_t const *)data +  0)));
+		w1 = vreinterpretq_u32_u8(vrev32q_u8(vld1q_u8((uint8_t const *)data + 16)));
+		w2 = vreinterpretq_u32_u8(vrev32q_u8(vld1q_u8((uint8_t const *)data + 32)));
+		w3 = vreinterpretq_u32_u8(vrev32q_u8(vld1q_u8((uint8_t const *)data + 48)));
+
+		QROUND( 0, w0, w1, w2, w3, 1);
+		QROUND( 1, w1, w2, w3, w0, 1);
+		QROUND( 2, w2, w3, w0, w1, 1);
+		QROUND( 3, w3, w0, w1, w2, 1);
+		QROUND( 4, w0, w1, w2, w3, 1);
+		QROUND( 5, w1, w2, w3, w0, 1);
+		QROUND( 6, w2, w3, w0, w1, 1);
+		QROUND( 7, w3, w0, w1, w2, 1);
+		QROUND( 8, w0, w1, w2, w3, 1);
+		QROUND( 9, w1, w2, w3, w0, 1);
+		QROUND(10, w2, w3, w0, w1, 1);
+		QROUND(11, w3, w0, w1, w2, 1);
+		QROUND(12, w0, w1, w2, w3, 0);
+		QROUND(13, w1, w2, w3, w0, 0);
+		QROUND(14, w2, w3, w0, w1, 0);
+		QROUND(15, w3, w0, w1, w2, 0);
+
+		state0 = vaddq_u32(state0, abcd_save);
+		state1 = vaddq_u32(state1, efgh_save);
+
+		data += 64;
+	}
+
+	vst1q_u32(&state[0], state0);
+	vst1q_u32(&state[4], state1);
+}
+
+#else
+
+int sha256_armv8_supported (void)
+{
+	return 0;
+}
+
+void sha256_transform_armv8 (uint32_t state[8], char const * data, size_t blocks)
+{
+	sha256_transform_scalar(state, data, blocks);
+}
+
+#endif
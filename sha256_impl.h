@@ -0,0 +1,42 @@
+#ifndef __SHA256_IMPL_H__
+#define __SHA256_IMPL_H__
+
+/* internals shared between sha256.c and the hardware kernels */
+
+#include <stddef.h>
+#include <stdint.h>
+
+/* round constants and initial hash value */
+extern uint32_t const sha256_k[64];
+extern uint32_t const sha256_initial_state[8];
+
+/* widest multi-buffer kernel */
+#define SHA256_MAX_LANES 16
+
+/* compression function: process `blocks` consecutive 64-byte blocks */
+typedef void (*sha256_transform_fn) (uint32_t state[8], char const * data, size_t blocks);
+
+/* multi-buffer hash: hash as many messages of equal length as the kernel has lanes */
+typedef void (*sha256_mb_fn) (char const * const blocks[], size_t length, char * const results[]);
+
+void sha256_transform_scalar (uint32_t state[8], char const * data, size_t blocks);
+
+/* Write the final padded block(s) for a message of `length` bytes whose last
+ * `remain` (< 64) bytes start at `tail`. Returns the number of blocks (1 or 2). */
+size_t sha256_pad (char buffer[128], char const * tail, size_t remain, size_t length);
+
+/* each kernel has a "supported" check that is run once at startup.
+ * kernels for other architectures always report unsupported */
+int sha256_shani_supported (void);
+void sha256_transform_shani (uint32_t state[8], char const * data, size_t blocks);
+
+int sha256_armv8_supported (void);
+void sha256_transform_armv8 (uint32_t state[8], char const * data, size_t blocks);
+
+int sha256_avx2_supported (void);
+void sha256_mb_avx2 (char const * const blocks[], size_t length, char * const results[]);
+
+int sha256_avx512_supported (void);
+void sha256_mb_avx512 (char const * const blocks[], size_t length, char * const results[]);
+
+#endif
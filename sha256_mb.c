@@ -0,0 +1,78 @@
+#include <stdint.h>
+#include <string.h>
+
+#include "sha256.h"
+#include "sha256_impl.h"
+
+/* Multi-buffer SHA256: hashes 8 (AVX2) or 16 (AVX-512) equal-length
+ * messages at once, one message per 32-bit SIMD lane. This only pays off
+ * without SHA extensions, which beat it on a single message. */
+
+#if defined(__x86_64__) || defined(__i386__)
+
+int sha256_avx2_supported (void)
+{
+	/* also checks that the OS saves the ymm/zmm registers */
+	return __builtin_cpu_supports("avx2");
+}
+
+int sha256_avx512_supported (void)
+{
+	return __builtin_cpu_supports("avx512f");
+}
+
+static inline uint32_t mb_load_be32 (char const * p)
+{
+	uint32_t v;
+	memcpy(&v, p, sizeof(v));
+	return __builtin_bswap32(v);
+}
+
+/* same functions as in sha256.c, on vectors */
+#define MB_ROTR(x, n) (((x) >> (n)) | ((x) << (32 - (n))))
+#define MB_CH(x, y, z) (((x) & (y)) ^ (~(x) & (z)))
+#define MB_MAJ(x, y, z) (((x) & (y)) ^ ((x) & (z)) ^ ((y) & (z)))
+#define MB_EP0(x) (MB_ROTR(x, 2) ^ MB_ROTR(x, 13) ^ MB_ROTR(x, 22))
+#define MB_EP1(x) (MB_ROTR(x, 6) ^ MB_ROTR(x, 11) ^ MB_ROTR(x, 25))
+#define MB_SIG0(x) (MB_ROTR(x, 7) ^ MB_ROTR(x, 18) ^ ((x) >> 3))
+#define MB_SIG1(x) (MB_ROTR(x, 17) ^ MB_ROTR(x, 19) ^ ((x) >> 10))
+
+#define MB_FUNC sha256_mb_avx2
+#define MB_LANES 8
+#define MB_TARGET "avx2"
+#include "sha256_mb.h"
+#undef MB_FUNC
+#undef MB_LANES
+#undef MB_TARGET
+
+#define MB_FUNC sha256_mb_avx512
+#define MB_LANES 16
+#define MB_TARGET "avx512f"
+#include "sha256_mb.h"
+#undef MB_FUNC
+#undef MB_LANES
+#undef MB_TARGET
+
+#else
+
+int sha256_avx2_supported (void)
+{
+	return 0;
+}
+
+int sha256_avx512_supported (void)
+{
+	return 0;
+}
+
+void sha256_mb_avx2 (char const * const blocks[], size_t length, char * const results[])
+{
+	for (int l = 0; l < 8; ++l) sha256_hash_block(blocks[l], length, results[l]);
+}
+
+void sha256_mb_avx512 (char const * const blocks[], size_t length, char * const results[])
+{
+	for (int l = 0; l < 16; ++l) sha256_hash_block(blocks[l], length, results[l]);
+}
+
+#endif
@@ -0,0 +1,101 @@
+/* Multi-buffer SHA256 kernel template, included by sha256_mb.c once per
+ * instruction set. Expects MB_FUNC (name of the generated function),
+ * MB_LANES (messages hashed at once) and MB_TARGET (gcc target string).
+ *
+ * Each SIMD lane holds one message; all messages must have the same
+ * length, so every lane runs exactly the same sequence of rounds. */
+
+#define MB_CAT_(a, b) a ## b
+#define MB_CAT(a, b) MB_CAT_(a, b)
+#define MB_VEC MB_CAT(mb_vec, MB_LANES)
+#define MB_TRANSFORM MB_CAT(MB_FUNC, _transform)
+
+typedef uint32_t MB_VEC __attribute__((vector_size(4 * MB_LANES)));
+
+__attribute__((target(MB_TARGET)))
+static void MB_TRANSFORM (MB_VEC state[8], char const * const blocks[MB_LANES], size_t nblocks)
+{
+	uint32_t words[16][MB_LANES] __attribute__((aligned(4 * MB_LANES)));
+	MB_VEC a, b, c, d, e, f, g, h, t1, t2, m[16];
+
+	for (size_t n = 0; n < nblocks; ++n) {
+		/* transpose: word t of every lane goes into vector m[t] */
+		for (int l = 0; l < MB_LANES; ++l) {
+			char const * data = blocks[l] + 64 * n;
+			for (int t = 0; t < 16; ++t)
+				words[t][l] = mb_load_be32(data + 4 * t);
+		}
+		memcpy(m, words, sizeof(m));
+
+		a = state[0];
+		b = state[1];
+		c = state[2];
+		d = state[3];
+		e = state[4];
+		f = state[5];
+		g = state[6];
+		h = state[7];
+
+		for (int i = 0; i < 64; ++i) {
+			if (i >= 16)
+				m[i & 15] += MB_SIG1(m[(i - 2) & 15]) + m[(i - 7) & 15]
+				           + MB_SIG0(m[(i - 15) & 15]);
+
+			t1 = h + MB_EP1(e) + MB_CH(e, f, g) + sha256_k[i] + m[i & 15];
+			t2 = MB_EP0(a) + MB_MAJ(a, b, c);
+			h = g;
+			g = f;
+			f = e;
+			e = d + t1;
+			d = c;
+			c = b;
+			b = a;
+			a = t1 + t2;
+		}
+
+		state[0] += a;
+		state[1] += b;
+		state[2] += c;
+		state[3] += d;
+		state[4] += e;
+		state[5] += f;
+		state[6] += g;
+		state[7] += h;
+	}
+}
+
+__attribute__((target(MB_TARGET)))
+void MB_FUNC (char const * const blocks[], size_t length, char * const results[])
+{
+	MB_VEC state[8];
+	char const * ptrs[MB_LANES];
+	char pad[MB_LANES][128];
+	uint32_t words[8][MB_LANES] __attribute__((aligned(4 * MB_LANES)));
+	size_t padblocks = 0;
+
+	for (int i = 0; i < 8; ++i)
+		state[i] = (MB_VEC){ 0 } + sha256_initial_state[i];
+
+	/* whole 64-byte chunks straight from the messages */
+	for (int l = 0; l < MB_LANES; ++l)
+		ptrs[l] = blocks[l];
+	MB_TRANSFORM(state, ptrs, length / 64);
+
+	/* padding, same number of blocks in every lane */
+	for (int l = 0; l < MB_LANES; ++l) {
+		padblocks = sha256_pad(pad[l], blocks[l] + (length & ~(size_t)63), length & 63, length);
+		ptrs[l] = pad[l];
+	}
+	MB_TRANSFORM(state, ptrs, padblocks);
+
+	memcpy(words, state, sizeof(words));
+	for (int l = 0; l < MB_LANES; ++l) {
+		for (int i = 0; i < 8; ++i) {
+			uint32_t word = __builtin_bswap32(words[i][l]);
+			memcpy(results[l] + 4 * i, &word, sizeof(word));
+		}
+	}
+}
+
+#undef MB_TRANSFORM
+#undef MB_VEC
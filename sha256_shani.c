@@ -0,0 +1,112 @@
+#include <stdint.h>
+
+#include "sha256_impl.h"
+
+/* SHA256 compression using the Intel SHA extensions (SHA-NI).
+ * Structure follows the Intel whitepaper "Intel SHA Extensions" and
+ * the public domain SHA-Intrinsics code by Jeffrey Walton. */
+
+#if defined(__x86_64__) || defined(__i386__)
+
+#include <cpuid.h>
+#include <immintrin.h>
+
+int sha256_shani_supported (void)
+{
+	unsigned int eax, ebx, ecx, edx;
+
+	/* SSSE3 and SSE4.1 are needed for the shuffles and blends */
+	if (!__get_cpuid(1, &eax, &ebx, &ecx, &edx)) return 0;
+	if (!(ecx & bit_SSSE3) || !(ecx & bit_SSE4_1)) return 0;
+
+	if (!__get_cpuid_count(7, 0, &eax, &ebx, &ecx, &edx)) return 0;
+	return (ebx & bit_SHA) != 0;
+}
+
+/* Four rounds starting at round 4*G. WC holds the message words for these
+ * rounds, WP the previous four, WN the next four.
+ * MSG2: finish the schedule of WN, MSG1: start the schedule of WP for
+ * round 4*(G+3). */
+#define QROUND(G, WC, WP, WN, MSG2, MSG1) do { \
+	msg = _mm_add_epi32(WC, _mm_loadu_si128((__m128i const *)&sha256_k[4 * (G)])); \
+	state1 = _mm_sha256rnds2_epu32(state1, state0, msg); \
+	if (MSG2) { \
+		tmp = _mm_alignr_epi8(WC, WP, 4); \
+		WN = _mm_add_epi32(WN, tmp); \
+		WN = _mm_sha256msg2_epu32(WN, WC); \
+	} \
+	msg = _mm_shuffle_epi32(msg, 0x0e); \
+	state0 = _mm_sha256rnds2_epu32(state0, state1, msg); \
+	if (MSG1) WP = _mm_sha256msg1_epu32(WP, WC); \
+} while (0)
+
+__attribute__((target("sha,sse4.1")))
+void sha256_transform_shani (uint32_t state[8], char const * data, size_t blocks)
+{
+	__m128i state0, state1, msg, tmp, abef_save, cdgh_save;
+	__m128i w0, w1, w2, w3;
+	__m128i const bswap_mask = _mm_set_epi64x(0x0c0d0e0f08090a0bULL, 0x0405060700010203ULL);
+
+	/* load state and shuffle it into ABEF / CDGH order */
+	tmp = _mm_loadu_si128((__m128i const *)&state[0]);
+	state1 = _mm_loadu_si128((__m128i const *)&state[4]);
+	tmp = _mm_shuffle_epi32(tmp, 0xb1);            /* CDAB */
+	state1 = _mm_shuffle_epi32(state1, 0x1b);      /* EFGH */
+	state0 = _mm_alignr_epi8(tmp, state1, 8);      /* ABEF */
+	state1 = _mm_blend_epi16(state1, tmp, 0xf0);   /* CDGH */
+
+	while (blocks--) {
+		abef_save = state0;
+		cdgh_save = state1;
+
+		w0 = _mm_shuffle_epi8(_mm_loadu_si128((__m128i const *)(data +  0)), bswap_mask);
+		w1 = _mm_shuffle_epi8(_mm_loadu_si128((__m128i const *)(data + 16)), bswap_mask);
+		w2 = _mm_shuffle_epi8(_mm_loadu_si128((__m128i const *)(data + 32)), bswap_mask);
+		w3 = _mm_shuffle_epi8(_mm_loadu_si128((__m128i const *)(data + 48)), bswap_mask);
+
+		QROUND( 0, w0, w3, w1, 0, 0);
+		QROUND( 1, w1, w0, w2, 0, 1);
+		QROUND( 2, w2, w1, w3, 0, 1);
+		QROUND( 3, w3, w2, w0, 1, 1);
+		QROUND( 4, w0, w3, w1, 1, 1);
+		QROUND( 5, w1, w0, w2, 1, 1);
+		QROUND( 6, w2, w1, w3, 1, 1);
+		QROUND( 7, w3, w2, w0, 1, 1);
+		QROUND( 8, w0, w3, w1, 1, 1);
+		QROUND( 9, w1, w0, w2, 1, 1);
+		QROUND(10, w2, w1, w3, 1, 1);
+		QROUND(11, w3, w2, w0, 1, 1);
+		QROUND(12, w0, w3, w1, 1, 1);
+		QROUND(13, w1, w0, w2, 1, 0);
+		QROUND(14, w2, w1, w3, 1, 0);
+		QROUND(15, w3, w2, w0, 0, 0);
+
+		state0 = _mm_add_epi32(state0, abef_save);
+		state1 = _mm_add_epi32(state1, cdgh_save);
+
+		data += 64;
+	}
+
+	/* shuffle back to ABCD / EFGH */
+	tmp = _mm_shuffle_epi32(state0, 0x1b);         /* FEBA */
+	state1 = _mm_shuffle_epi32(state1, 0xb1);      /* DCHG */
+	state0 = _mm_blend_epi16(tmp, state1, 0xf0);   /* DCBA */
+	state1 = _mm_alignr_epi8(state1, tmp, 8);      /* ABEF */
+
+	_mm_storeu_si128((__m128i *)&state[0], state0);
+	_mm_storeu_si128((__m128i *)&state[4], state1);
+}
+
+#else
+
+int sha256_shani_supported (void)
+{
+	return 0;
+}
+
+void sha256_transform_shani (uint32_t state[8], char const * data, size_t blocks)
+{
+	sha256_transform_scalar(state, data, blocks);
+}
+
+#endif
@@ -0,0 +1,291 @@
+#include <stdlib.h>
+#include <string.h>
+
+#include "stats.h"
+
+/* queue depths are sampled this often */
+#define SAMPLE_NS (10 * 1000 * 1000)
+
+stats_t stats;
+stats_format_t stats_enabled = STATS_OFF;
+
+typedef struct stats_queue {
+	char const * name;
+	queue_t * queue;
+	uint64_t samples;
+	uint64_t depth_total;
+	size_t depth_max;
+} stats_queue_t;
+
+typedef struct stats_thread {
+	char const * stage;
+	clockid_t clock;
+} stats_thread_t;
+
+static struct {
+	FILE * out;
+	uint64_t interval_ns;
+	uint64_t start_ns;
+
+	pthread_mutex_t mutex;	/* guards the registries and samples */
+	pthread_cond_t stop_cond;
+	int stop;
+	pthread_t sampler;
+
+	stats_queue_t * queues;
+	int nqueues;
+	stats_thread_t * threads;
+	int nthreads;
+} state = {
+	.mutex = PTHREAD_MUTEX_INITIALIZER,
+	.stop_cond = PTHREAD_COND_INITIALIZER,
+};
+
+void stats_hist_add (stats_hist_t * hist, uint64_t ns)
+{
+	int bucket = ns ? 63 - __builtin_clzll(ns) : 0;
+	if (bucket >= STATS_BUCKETS) bucket = STATS_BUCKETS - 1;
+
+	atomic_fetch_add_explicit(&hist->count[bucket], 1, memory_order_relaxed);
+	atomic_fetch_add_explicit(&hist->total_ns, ns, memory_order_relaxed);
+	uint64_t max = atomic_load_explicit(&hist->max_ns, memory_order_relaxed);
+	while (ns > max && !atomic_compare_exchange_weak_explicit(&hist->max_ns, &max, ns,
+			memory_order_relaxed, memory_order_relaxed));
+}
+
+static double seconds (uint64_t ns)
+{
+	return ns / 1e9;
+}
+
+/* upper bound of the bucket that holds the given fraction of samples, in us */
+static double percentile (stats_hist_t * hist, uint64_t count, double fraction)
+{
+	uint64_t seen = 0;
+	for (int i = 0; i < STATS_BUCKETS; ++i) {
+		seen += hist->count[i];
+		if (seen && seen >= fraction * count) return (2ull << i) / 1e3;
+	}
+	return 0;
+}
+
+static void print_hist (char const * name, stats_hist_t * hist, int json)
+{
+	uint64_t count = 0;
+	for (int i = 0; i < STATS_BUCKETS; ++i) count += hist->count[i];
+	double mean = count ? hist->total_ns / 1e3 / count : 0;
+
+	if (json) {
+		fprintf(state.out, "\"%s\":{\"count\":%llu,\"mean_us\":%.3f,\"p50_us\":%.3f,"
+		        "\"p90_us\":%.3f,\"p99_us\":%.3f,\"max_us\":%.3f,\"buckets\":[",
+		        name, (unsigned long long)count, mean, percentile(hist, count, 0.5),
+		        percentile(hist, count, 0.9), percentile(hist, count, 0.99),
+		        hist->max_ns / 1e3);
+		for (int i = 0; i < STATS_BUCKETS; ++i)
+			fprintf(state.out, "%s%llu", i ? "," : "", (unsigned long long)hist->count[i]);
+		fprintf(state.out, "]}");
+	} else {
+		fprintf(state.out, "  %s latency: %llu samples, mean %.1f us, p50 < %.1f us, "
+		        "p90 < %.1f us, p99 < %.1f us, max %.1f us\n",
+		        name, (unsigned long long)count, mean, percentile(hist, count, 0.5),
+		        percentile(hist, count, 0.9), percentile(hist, count, 0.99),
+		        hist->max_ns / 1e3);
+	}
+}
+
+static uint64_t thread_cpu_ns (stats_thread_t * thread)
+{
+	struct timespec ts;
+	if (clock_gettime(thread->clock, &ts) == -1) return 0;
+	return ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+/* called with mutex held */
+static void report (uint64_t now)
+{
+	int json = stats_enabled == STATS_JSON;
+	double elapsed = seconds(now - state.start_ns);
+	FILE * out = state.out;
+
+	if (json) {
+		fprintf(out, "{\"elapsed_s\":%.3f,\"files\":%llu,\"errors\":%llu,\"cache_hits\":%llu,"
+		        "\"bytes_read\":%llu,\"blocks_hashed\":%llu,\"blocks_reused\":%llu,\"blocks_sparse\":%llu,\"scan_s\":%.3f,\"queues\":{",
+		        elapsed, (unsigned long long)stats.files, (unsigned long long)stats.errors,
+		        (unsigned long long)stats.cache_hits, (unsigned long long)stats.bytes_read,
+		        (unsigned long long)stats.blocks_hashed, (unsigned long long)stats.blocks_reused,
+		        (unsigned long long)stats.blocks_sparse,
+		        seconds(stats.scan_ns));
+	} else {
+		fprintf(out, "fastsum stats after %.2f s:\n", elapsed);
+		fprintf(out, "  %llu files, %llu errors, %llu cache hits\n",
+		        (unsigned long long)stats.files, (unsigned long long)stats.errors,
+		        (unsigned long long)stats.cache_hits);
+		fprintf(out, "  %llu bytes read (%.1f MB/s), %llu blocks hashed\n",
+		        (unsigned long long)stats.bytes_read,
+		        elapsed > 0 ? stats.bytes_read / elapsed / 1e6 : 0,
+		        (unsigned long long)stats.blocks_hashed);
+		if (stats.blocks_reused)
+			fprintf(out, "  %llu block hashes reused\n", (unsigned long long)stats.blocks_reused);
+		if (stats.blocks_sparse)
+			fprintf(out, "  %llu blocks of holes skipped\n", (unsigned long long)stats.blocks_sparse);
+		if (stats.scan_ns)
+			fprintf(out, "  directory scan took %.2f s\n", seconds(stats.scan_ns));
+	}
+
+	for (int i = 0; i < state.nqueues; ++i) {
+		stats_queue_t * q = &state.queues[i];
+		double avg = q->samples ? (double)q->depth_total / q->samples : 0;
+		if (json) {
+			fprintf(out, "%s\"%s\":{\"depth_avg\":%.1f,\"depth_max\":%zu,\"push_waits\":%llu,"
+			        "\"push_wait_s\":%.3f,\"pop_waits\":%llu,\"pop_wait_s\":%.3f}",
+			        i ? "," : "", q->name, avg, q->depth_max,
+			        (unsigned long long)q->queue->push_waits, seconds(q->queue->push_wait_ns),
+			        (unsigned long long)q->queue->pop_waits, seconds(q->queue->pop_wait_ns));
+		} else {
+			fprintf(out, "  %s queue: depth avg %.1f, max %zu; push blocked %.2f s (%llu times), "
+			        "pop blocked %.2f s (%llu times)\n",
+			        q->name, avg, q->depth_max,
+			        seconds(q->queue->push_wait_ns), (unsigned long long)q->queue->push_waits,
+			        seconds(q->queue->pop_wait_ns), (unsigned long long)q->queue->pop_waits);
+		}
+	}
+
+	if (json) {
+		fprintf(out, "},\"threads\":[");
+		for (int i = 0; i < state.nthreads; ++i)
+			fprintf(out, "%s{\"stage\":\"%s\",\"cpu_s\":%.3f}", i ? "," : "",
+			        state.threads[i].stage, seconds(thread_cpu_ns(&state.threads[i])));
+		fprintf(out, "],\"latency\":{");
+		print_hist("read", &stats.read_latency, 1);
+		fprintf(out, ",");
+		print_hist("hash", &stats.hash_latency, 1);
+		fprintf(out, "}}\n");
+	} else {
+		/* per stage: total and busiest thread */
+		for (int i = 0; i < state.nthreads; ++i) {
+			char const * stage = state.threads[i].stage;
+			int seen = 0;
+			for (int j = 0; j < i; ++j)
+				if (!strcmp(state.threads[j].stage, stage)) seen = 1;
+			if (seen) continue;
+
+			int count = 0;
+			uint64_t total = 0, busiest = 0;
+			for (int j = i; j < state.nthreads; ++j) {
+				if (strcmp(state.threads[j].stage, stage)) continue;
+				uint64_t cpu = thread_cpu_ns(&state.threads[j]);
+				count += 1;
+				total += cpu;
+				if (cpu > busiest) busiest = cpu;
+			}
+			fprintf(out, "  %s threads: %d, cpu %.2f s (%.0f%% of elapsed each on average), "
+			        "busiest %.2f s\n", stage, count, seconds(total),
+			        elapsed > 0 ? 100 * seconds(total) / count / elapsed : 0, seconds(busiest));
+		}
+		print_hist("read", &stats.read_latency, 0);
+		print_hist("hash", &stats.hash_latency, 0);
+	}
+	fflush(out);
+}
+
+static void * sampler (void * unused)
+{
+	uint64_t next_report = state.start_ns + state.interval_ns;
+
+	pthread_mutex_lock(&state.mutex);
+	while (!state.stop) {
+		for (int i = 0; i < state.nqueues; ++i) {
+			stats_queue_t * q = &state.queues[i];
+			size_t depth = queue_depth(q->queue);
+			q->samples += 1;
+			q->depth_total += depth;
+			if (depth > q->depth_max) q->depth_max = depth;
+		}
+
+		uint64_t now = stats_clock();
+		if (state.interval_ns && now >= next_report) {
+			report(now);
+			next_report += state.interval_ns;
+		}
+
+		now += SAMPLE_NS;
+		struct timespec until = { .tv_sec = now / 1000000000ull, .tv_nsec = now % 1000000000ull };
+		pthread_cond_timedwait(&state.stop_cond, &state.mutex, &until);
+	}
+	pthread_mutex_unlock(&state.mutex);
+	return NULL;
+}
+
+void stats_start (stats_format_t format, double interval, FILE * out)
+{
+	stats_enabled = format;
+	if (!stats_enabled) return;
+
+	state.out = out;
+	state.interval_ns = interval * 1e9;
+	state.start_ns = stats_clock();
+
+	/* timedwait on a monotonic deadline */
+	pthread_condattr_t attr;
+	pthread_condattr_init(&attr);
+	pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+	pthread_cond_destroy(&state.stop_cond);
+	pthread_cond_init(&state.stop_cond, &attr);
+	pthread_condattr_destroy(&attr);
+
+	pthread_create(&state.sampler, NULL, sampler, NULL);
+	pthread_setname_np(state.sampler, "fastsum-stats");
+}
+
+void stats_add_queue (char const * name, queue_t * queue)
+{
+	if (!stats_enabled) return;
+
+	/* its waits are timed from now on; without the memory, it is left
+	 * out of the samples */
+	queue->timed = 1;
+	pthread_mutex_lock(&state.mutex);
+	stats_queue_t * queues = realloc(state.queues, (state.nqueues + 1) * sizeof(stats_queue_t));
+	if (queues) {
+		state.queues = queues;
+		state.queues[state.nqueues++] = (stats_queue_t){ .name = name, .queue = queue };
+	}
+	pthread_mutex_unlock(&state.mutex);
+}
+
+void stats_add_thread (char const * stage, pthread_t thread)
+{
+	if (!stats_enabled) return;
+
+	clockid_t clock;
+	if (pthread_getcpuclockid(thread, &clock)) return;
+
+	pthread_mutex_lock(&state.mutex);
+	stats_thread_t * threads = realloc(state.threads, (state.nthreads + 1) * sizeof(stats_thread_t));
+	if (threads) {
+		state.threads = threads;
+		state.threads[state.nthreads++] = (stats_thread_t){ .stage = stage, .clock = clock };
+	}
+	pthread_mutex_unlock(&state.mutex);
+}
+
+void stats_finish (void)
+{
+	if (!stats_enabled) return;
+
+	pthread_mutex_lock(&state.mutex);
+	state.stop = 1;
+	pthread_cond_signal(&state.stop_cond);
+	pthread_mutex_unlock(&state.mutex);
+	pthread_join(state.sampler, NULL);
+
+	pthread_mutex_lock(&state.mutex);
+	report(stats_clock());
+	pthread_mutex_unlock(&state.mutex);
+
+	free(state.queues);
+	free(state.threads);
+	state.queues = NULL;
+	state.threads = NULL;
+	state.nqueues = state.nthreads = 0;
+}
@@ -0,0 +1,77 @@
+#ifndef __STATS_H__
+#define __STATS_H__
+
+#include <stdint.h>
+#include <stdio.h>
+#include <time.h>
+#include <pthread.h>
+#include <stdatomic.h>
+
+#include "queue.h"
+
+/* Pipeline instrumentation (--stats). Counters and latency histograms are
+ * updated by the workers only when stats are enabled. A sampler thread
+ * looks at the depth of the registered queues every few milliseconds and
+ * prints a report every --stats-interval seconds; the last one is printed
+ * by stats_finish. Thread busy time is the CPU time of each registered
+ * thread. */
+
+/* latency histogram, bucket i counts samples of [2^i, 2^(i+1)) ns */
+#define STATS_BUCKETS 40
+
+typedef struct stats_hist {
+	_Atomic uint64_t count[STATS_BUCKETS];
+	_Atomic uint64_t total_ns;
+	_Atomic uint64_t max_ns;
+} stats_hist_t;
+
+typedef struct stats {
+	_Atomic uint64_t files;
+	_Atomic uint64_t errors;
+	_Atomic uint64_t cache_hits;
+	_Atomic uint64_t bytes_read;
+	_Atomic uint64_t blocks_hashed;
+	_Atomic uint64_t blocks_reused;	/* from L1 hash sidecars */
+	_Atomic uint64_t blocks_sparse;	/* holes, not read */
+	_Atomic uint64_t scan_ns;	/* until the directory walk was done */
+
+	stats_hist_t read_latency;	/* one read() or io_uring read */
+	stats_hist_t hash_latency;	/* one call of the SHA256 kernel */
+} stats_t;
+
+typedef enum { STATS_OFF, STATS_TEXT, STATS_JSON } stats_format_t;
+
+extern stats_t stats;
+extern stats_format_t stats_enabled;
+
+static inline uint64_t stats_clock (void)
+{
+	if (!stats_enabled) return 0;
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+static inline void stats_count (_Atomic uint64_t * counter, uint64_t n)
+{
+	if (stats_enabled) atomic_fetch_add_explicit(counter, n, memory_order_relaxed);
+}
+
+void stats_hist_add (stats_hist_t * hist, uint64_t ns);
+
+/* record the time since `start`, a value from stats_clock */
+static inline void stats_record (stats_hist_t * hist, uint64_t start)
+{
+	if (stats_enabled) stats_hist_add(hist, stats_clock() - start);
+}
+
+/* `interval` in seconds, 0 for a report at the end only */
+void stats_start (stats_format_t format, double interval, FILE * out);
+/* sample the depth of `queue` and time its sleeps; before it is used */
+void stats_add_queue (char const * name, queue_t * queue);
+void stats_add_thread (char const * stage, pthread_t thread);
+/* stop sampling and print the final report. call before the registered
+ * threads are joined, their CPU clocks go away with them */
+void stats_finish (void);
+
+#endif
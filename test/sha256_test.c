@@ -0,0 +1,133 @@
+/* SHA256 kernel test: every kernel this CPU supports must give the NIST
+ * example digests, and agree with the scalar code for all message
+ * lengths up to three blocks and a byte, through sha256_hash_block and
+ * through sha256_hash_blocks at every number of messages up to two full
+ * sets of lanes and one more. Prints one line per kernel, exits 1 on any
+ * mismatch. */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "sha256.h"
+
+#define MAX_LENGTH (3 * 64 + 1)
+#define MAX_COUNT (2 * 16 + 1)
+#define BLOCKSIZE (16 * 1024)
+
+static struct {
+	char const * message;
+	size_t repeat;
+	char const * digest;
+} const vectors[] = {
+	{ "", 1, "e3b0c44298fc1c149afbf4c8996fb92427ae41e4649b934ca495991b7852b855" },
+	{ "abc", 1, "ba7816bf8f01cfea414140de5dae2223b00361a396177a9cb410ff61f20015ad" },
+	{ "abcdbcdecdefdefgefghfghighijhijkijkljklmklmnlmnomnopnopq", 1,
+	  "248d6a61d20638b8e5c026930c3e6039a33ce45964ff2167f6ecedd419db06c1" },
+	{ "abcdefghbcdefghicdefghijdefghijkefghijklfghijklmghijklmnhijklmnoijklmnopjklmnopqklmnopqrlmnopqrsmnopqrstnopqrstu", 1,
+	  "cf5b16a778af8380036ce59e7b0492370b249b11e8f07a51afac45037afee9d1" },
+	{ "a", 1000000, "cdc76e5c9914fb9281a1c7e284d73e67f1809a48a497200e046d39ccc7112cd0" },
+};
+
+#define VECTOR_COUNT (sizeof(vectors) / sizeof(vectors[0]))
+
+/* message lengths for sha256_hash_blocks */
+static size_t const lengths[] = { 0, 1, 55, 56, 63, 64, 65, 119, 120, 128, MAX_LENGTH, BLOCKSIZE };
+
+#define LENGTH_COUNT (sizeof(lengths) / sizeof(lengths[0]))
+
+static void hex (char const * hash, char * out)
+{
+	for (int i = 0; i < HASH_SIZE; ++i)
+		sprintf(out + 2 * i, "%02x", (unsigned char)hash[i]);
+}
+
+static int check_vectors (char const * kernel)
+{
+	int failed = 0;
+
+	for (size_t i = 0; i < VECTOR_COUNT; ++i) {
+		size_t size = strlen(vectors[i].message);
+		size_t length = size * vectors[i].repeat;
+		char * message = malloc(length + 1);
+		if (message == NULL) return 1;
+		for (size_t r = 0; r < vectors[i].repeat; ++r)
+			memcpy(message + r * size, vectors[i].message, size);
+
+		char hash[HASH_SIZE], digest[2 * HASH_SIZE + 1];
+		sha256_hash_block(message, length, hash);
+		hex(hash, digest);
+		if (strcmp(digest, vectors[i].digest)) {
+			fprintf(stderr, "%s: NIST vector %zu: got %s, expected %s\n",
+			        kernel, i, digest, vectors[i].digest);
+			failed = 1;
+		}
+		free(message);
+	}
+	return failed;
+}
+
+int main (void)
+{
+	static char const * const kernels[] = { "scalar", "shani", "armv8", "avx2", "avx512" };
+	static char expect_block[MAX_LENGTH + 1][HASH_SIZE];
+	static char expect_blocks[LENGTH_COUNT][MAX_COUNT][HASH_SIZE];
+	static char results[MAX_COUNT][HASH_SIZE];
+	char const * blocks[MAX_COUNT];
+	char * result_ptrs[MAX_COUNT];
+	int failed = 0;
+
+	char * data = malloc(MAX_COUNT * BLOCKSIZE);
+	if (data == NULL) return 1;
+	srand(1);
+	for (size_t i = 0; i < MAX_COUNT * BLOCKSIZE; ++i) data[i] = rand();
+	for (int i = 0; i < MAX_COUNT; ++i) {
+		blocks[i] = data + i * BLOCKSIZE;
+		result_ptrs[i] = results[i];
+	}
+
+	/* the scalar code is what every other kernel is held to */
+	if (sha256_select_kernel("scalar") == -1) return 1;
+	for (size_t length = 0; length <= MAX_LENGTH; ++length)
+		sha256_hash_block(data, length, expect_block[length]);
+	for (size_t l = 0; l < LENGTH_COUNT; ++l)
+		for (int i = 0; i < MAX_COUNT; ++i)
+			sha256_hash_block(blocks[i], lengths[l], expect_blocks[l][i]);
+
+	for (size_t k = 0; k < sizeof(kernels) / sizeof(kernels[0]); ++k) {
+		char const * kernel = kernels[k];
+		if (sha256_select_kernel(kernel) == -1) {
+			printf("%s: not supported\n", kernel);
+			continue;
+		}
+		int kernel_failed = check_vectors(kernel);
+
+		for (size_t length = 0; length <= MAX_LENGTH; ++length) {
+			char hash[HASH_SIZE];
+			sha256_hash_block(data, length, hash);
+			if (memcmp(hash, expect_block[length], HASH_SIZE)) {
+				fprintf(stderr, "%s: hash_block of %zu bytes differs from scalar\n", kernel, length);
+				kernel_failed = 1;
+			}
+		}
+
+		for (size_t l = 0; l < LENGTH_COUNT; ++l) {
+			for (int count = 1; count <= MAX_COUNT; ++count) {
+				memset(results, 0, sizeof(results));
+				sha256_hash_blocks(blocks, lengths[l], result_ptrs, count);
+				for (int i = 0; i < count; ++i) {
+					if (!memcmp(results[i], expect_blocks[l][i], HASH_SIZE)) continue;
+					fprintf(stderr, "%s: hash_blocks of %d x %zu bytes: message %d differs "
+					        "from scalar\n", kernel, count, lengths[l], i);
+					kernel_failed = 1;
+				}
+			}
+		}
+
+		printf("%s: %s (%d lanes)\n", kernel, kernel_failed ? "FAILED" : "ok", sha256_lanes());
+		failed |= kernel_failed;
+	}
+
+	free(data);
+	return failed;
+}
@@ -1,11 +1,8 @@
 #ifndef TOOLS_H__
 #define	TOOLS_H__
 
-/* same as malloc, except zeroes out allocated memory
-and dies if allocation fails */
+/* same as malloc, except zeroes out allocated memory */
 void * xmalloc (size_t);
-/* same as realloc, except dies when fails */
-void * xrealloc (void *, size_t);
 /* same as strncpy, except sets dest[n] to zero */
 char * strncpyz (char *, char const *, size_t);
 
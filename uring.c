@@ -0,0 +1,152 @@
+#include <errno.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <sys/mman.h>
+#include <sys/syscall.h>
+
+#include "uring.h"
+
+static int sys_setup (unsigned entries, struct io_uring_params * p)
+{
+	return syscall(__NR_io_uring_setup, entries, p);
+}
+
+static int sys_enter (int fd, unsigned to_submit, unsigned min_complete, unsigned flags)
+{
+	return syscall(__NR_io_uring_enter, fd, to_submit, min_complete, flags, NULL, 0);
+}
+
+int uring_init (uring_t * ring, unsigned entries)
+{
+	struct io_uring_params p;
+
+	memset(ring, 0, sizeof(uring_t));
+	memset(&p, 0, sizeof(p));
+
+	ring->fd = sys_setup(entries, &p);
+	if (ring->fd == -1) return -1;
+	ring->entries = p.sq_entries;
+
+	ring->sq_ring_size = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+	ring->cq_ring_size = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+	if (p.features & IORING_FEAT_SINGLE_MMAP) {
+		/* both rings live in one mapping */
+		if (ring->cq_ring_size > ring->sq_ring_size) ring->sq_ring_size = ring->cq_ring_size;
+		ring->cq_ring_size = ring->sq_ring_size;
+	}
+
+	ring->sq_ring = mmap(NULL, ring->sq_ring_size, PROT_READ | PROT_WRITE,
+	                     MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQ_RING);
+	if (ring->sq_ring == MAP_FAILED) goto error;
+
+	if (p.features & IORING_FEAT_SINGLE_MMAP) {
+		ring->cq_ring = ring->sq_ring;
+	} else {
+		ring->cq_ring = mmap(NULL, ring->cq_ring_size, PROT_READ | PROT_WRITE,
+		                     MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_CQ_RING);
+		if (ring->cq_ring == MAP_FAILED) goto error;
+	}
+
+	ring->sqes_size = p.sq_entries * sizeof(struct io_uring_sqe);
+	ring->sqes = mmap(NULL, ring->sqes_size, PROT_READ | PROT_WRITE,
+	                  MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQES);
+	if (ring->sqes == MAP_FAILED) goto error;
+
+	char * sq = ring->sq_ring;
+	ring->sq_head = (unsigned *)(sq + p.sq_off.head);
+	ring->sq_tail = (unsigned *)(sq + p.sq_off.tail);
+	ring->sq_mask = (unsigned *)(sq + p.sq_off.ring_mask);
+	ring->sq_array = (unsigned *)(sq + p.sq_off.array);
+
+	char * cq = ring->cq_ring;
+	ring->cq_head = (unsigned *)(cq + p.cq_off.head);
+	ring->cq_tail = (unsigned *)(cq + p.cq_off.tail);
+	ring->cq_mask = (unsigned *)(cq + p.cq_off.ring_mask);
+	ring->cqes = (struct io_uring_cqe *)(cq + p.cq_off.cqes);
+
+	return 0;
+
+error: ;
+	int err = errno;
+	uring_free(ring);
+	errno = err;
+	return -1;
+}
+
+void uring_free (uring_t * ring)
+{
+	if (ring->sqes && ring->sqes != MAP_FAILED) munmap(ring->sqes, ring->sqes_size);
+	if (ring->cq_ring && ring->cq_ring != MAP_FAILED && ring->cq_ring != ring->sq_ring)
+		munmap(ring->cq_ring, ring->cq_ring_size);
+	if (ring->sq_ring && ring->sq_ring != MAP_FAILED) munmap(ring->sq_ring, ring->sq_ring_size);
+	if (ring->fd >= 0) close(ring->fd);
+	ring->fd = -1;
+}
+
+int uring_register_buffers (uring_t * ring, struct iovec const * iovecs, unsigned count)
+{
+	return syscall(__NR_io_uring_register, ring->fd, IORING_REGISTER_BUFFERS, iovecs, count);
+}
+
+struct io_uring_sqe * uring_get_sqe (uring_t * ring)
+{
+	unsigned head = __atomic_load_n(ring->sq_head, __ATOMIC_ACQUIRE);
+	unsigned tail = *ring->sq_tail + ring->sq_pending;
+
+	if (tail - head >= ring->entries) return NULL;
+
+	unsigned index = tail & *ring->sq_mask;
+	struct io_uring_sqe * sqe = &ring->sqes[index];
+	ring->sq_array[index] = index;
+	ring->sq_pending += 1;
+
+	memset(sqe, 0, sizeof(*sqe));
+	return sqe;
+}
+
+int uring_submit (uring_t * ring, unsigned wait_nr)
+{
+	unsigned flags = wait_nr ? IORING_ENTER_GETEVENTS : 0;
+
+	/* publish the filled sqes to the kernel; those it didn't take last
+	 * time (EBUSY) go again */
+	__atomic_store_n(ring->sq_tail, *ring->sq_tail + ring->sq_pending, __ATOMIC_RELEASE);
+	ring->sq_pending = 0;
+	unsigned submit = *ring->sq_tail - __atomic_load_n(ring->sq_head, __ATOMIC_ACQUIRE);
+
+	if (!submit && !wait_nr) return 0;
+
+	int res;
+	do {
+		res = sys_enter(ring->fd, submit, wait_nr, flags);
+	} while (res == -1 && errno == EINTR);
+	return res;
+}
+
+struct io_uring_sqe * uring_unsubmit (uring_t * ring)
+{
+	if (ring->sq_pending) {
+		ring->sq_pending -= 1;
+		return &ring->sqes[(*ring->sq_tail + ring->sq_pending) & *ring->sq_mask];
+	}
+	/* without SQPOLL, the kernel only takes sqes in io_uring_enter */
+	unsigned tail = *ring->sq_tail;
+	if (tail == __atomic_load_n(ring->sq_head, __ATOMIC_ACQUIRE)) return NULL;
+	__atomic_store_n(ring->sq_tail, tail - 1, __ATOMIC_RELEASE);
+	return &ring->sqes[(tail - 1) & *ring->sq_mask];
+}
+
+struct io_uring_cqe * uring_peek_cqe (uring_t * ring)
+{
+	unsigned head = *ring->cq_head;
+	unsigned tail = __atomic_load_n(ring->cq_tail, __ATOMIC_ACQUIRE);
+
+	if (head == tail) return NULL;
+	return &ring->cqes[head & *ring->cq_mask];
+}
+
+void uring_cqe_seen (uring_t * ring)
+{
+	__atomic_store_n(ring->cq_head, *ring->cq_head + 1, __ATOMIC_RELEASE);
+}
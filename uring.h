@@ -0,0 +1,54 @@
+#ifndef __URING_H__
+#define __URING_H__
+
+#include <stddef.h>
+#include <sys/uio.h>
+#include <linux/io_uring.h>
+
+/* Minimal io_uring wrapper over the raw system calls, just enough for
+ * the reader engine; we don't want to depend on liburing. */
+
+typedef struct uring {
+	int fd;
+	unsigned entries;
+
+	/* submission queue */
+	unsigned * sq_head;
+	unsigned * sq_tail;
+	unsigned * sq_mask;
+	unsigned * sq_array;
+	struct io_uring_sqe * sqes;
+	unsigned sq_pending;	/* sqes filled but not yet submitted */
+
+	/* completion queue */
+	unsigned * cq_head;
+	unsigned * cq_tail;
+	unsigned * cq_mask;
+	struct io_uring_cqe * cqes;
+
+	void * sq_ring;
+	size_t sq_ring_size;
+	void * cq_ring;
+	size_t cq_ring_size;
+	size_t sqes_size;
+} uring_t;
+
+/* returns 0 on success, -1 and errno if io_uring is not available */
+int uring_init (uring_t * ring, unsigned entries);
+void uring_free (uring_t * ring);
+
+int uring_register_buffers (uring_t * ring, struct iovec const * iovecs, unsigned count);
+
+/* next free sqe, zeroed, or NULL if the submission queue is full */
+struct io_uring_sqe * uring_get_sqe (uring_t * ring);
+/* submit pending sqes and wait for at least `wait_nr` completions.
+ * returns number submitted or -1 and errno. after EBUSY (too many
+ * completions not reaped yet), the sqes are submitted by the next call */
+int uring_submit (uring_t * ring, unsigned wait_nr);
+/* take back the newest sqe the kernel has not taken yet, or NULL */
+struct io_uring_sqe * uring_unsubmit (uring_t * ring);
+/* next completion or NULL; call uring_cqe_seen when done with it */
+struct io_uring_cqe * uring_peek_cqe (uring_t * ring);
+void uring_cqe_seen (uring_t * ring);
+
+#endif